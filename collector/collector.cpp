@@ -0,0 +1,200 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "performan.h"
+
+// Attaches to the shared memory segments of instrumented processes (Profiler::EnableSharedMemory),
+// drains them concurrently and writes a single merged capture once interrupted or once every
+// attached process has exited.
+//
+// Usage: performan_collector [output=capture.pfm] [prefix=performan]
+
+namespace {
+    std::atomic<bool> running{ true };
+
+    void OnSignal(int)
+    {
+        running.store(false);
+    }
+
+    struct Segment {
+        Performan::SharedMemoryReader _reader;
+        std::thread _worker;
+        std::atomic<bool> _finished{ false };
+        uint64_t _dropped = 0;
+        uint64_t _droppedArgs = 0;
+        uint32_t _fallbackThreads = 0;
+        Performan::PortableNano _eventOverhead{ 0 };
+        Performan::PortableNano _frameOverhead{ 0 };
+
+        void Drain()
+        {
+            while (true)
+            {
+                // Sample liveness before draining so the last drain sees everything a dead process wrote
+                bool alive = _reader.IsProcessAlive();
+                size_t drained = _reader.Drain();
+                _dropped = _reader.Dropped();
+                _droppedArgs = _reader.DroppedArgs();
+                _fallbackThreads = _reader.FallbackThreads();
+                _eventOverhead = _reader.EventOverhead();
+                _frameOverhead = _reader.FrameOverhead();
+
+                if (!alive)
+                {
+                    // Process exited or crashed, its data is complete
+                    _reader.Close(true);
+                    break;
+                }
+
+                if (!running.load())
+                {
+                    _reader.Close(false);
+                    break;
+                }
+
+                if (drained == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+
+            _finished.store(true);
+        }
+    };
+
+    // Segments are named "/<prefix>.<pid>" and show up as "<prefix>.<pid>" in /dev/shm
+    std::vector<std::string> FindSegments(const std::string& prefix)
+    {
+        std::vector<std::string> names;
+        DIR* dir = opendir("/dev/shm");
+        if (dir == nullptr) {
+            return names;
+        }
+
+        std::string start = prefix + ".";
+        while (dirent* entry = readdir(dir))
+        {
+            if (strncmp(entry->d_name, start.c_str(), start.size()) == 0) {
+                names.push_back(std::string("/") + entry->d_name);
+            }
+        }
+
+        closedir(dir);
+        return names;
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string output = argc > 1 ? argv[1] : "capture.pfm";
+    std::string prefix = argc > 2 ? argv[2] : "performan";
+
+    std::signal(SIGINT, OnSignal);
+    std::signal(SIGTERM, OnSignal);
+
+    std::map<std::string, std::unique_ptr<Segment>> segments;
+
+    std::cout << "Waiting for segments /dev/shm/" << prefix << ".*" << std::endl;
+
+    while (running.load())
+    {
+        for (const std::string& name : FindSegments(prefix))
+        {
+            if (segments.count(name)) {
+                continue;
+            }
+
+            // Segments still being created are picked up on a later scan
+            auto segment = std::make_unique<Segment>();
+            if (!segment->_reader.Open(name.c_str())) {
+                continue;
+            }
+
+            std::cout << "Attached to process " << segment->_reader.ProcessId() << " (" << name << ")" << std::endl;
+            segment->_worker = std::thread(&Segment::Drain, segment.get());
+            segments.emplace(name, std::move(segment));
+        }
+
+        bool finished = !segments.empty();
+        for (const auto& [name, segment] : segments) {
+            finished = finished && segment->_finished.load();
+        }
+
+        if (finished) {
+            break;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    running.store(false);
+
+    // Processes of a machine calibrate close overheads, the capture keeps their mean
+    Performan::CaptureHeader header;
+    int64_t calibrated = 0;
+    for (auto& [name, segment] : segments)
+    {
+        segment->_worker.join();
+
+        if (segment->_eventOverhead > Performan::PortableNano(0))
+        {
+            header._eventOverhead += segment->_eventOverhead;
+            header._frameOverhead += segment->_frameOverhead;
+            calibrated++;
+        }
+    }
+    if (calibrated > 0)
+    {
+        header._eventOverhead /= calibrated;
+        header._frameOverhead /= calibrated;
+    }
+
+    Performan::WriteStream wStream(&Performan::GetDefaultAllocator());
+    header.Serialize(wStream);
+    size_t threadCount = 0;
+    size_t eventCount = 0;
+    uint64_t dropped = 0;
+    uint64_t droppedArgs = 0;
+    uint32_t fallbackThreads = 0;
+
+    for (auto& [name, segment] : segments)
+    {
+        for (Performan::Thread& thread : segment->_reader.Threads())
+        {
+            if (thread._name == nullptr) {
+                continue;
+            }
+
+            thread.Serialize(wStream);
+            threadCount++;
+            eventCount += thread._events.size();
+        }
+
+        dropped += segment->_dropped;
+        droppedArgs += segment->_droppedArgs;
+        fallbackThreads += segment->_fallbackThreads;
+    }
+
+    std::ofstream file(output, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(wStream.Data()), static_cast<std::streamsize>(wStream.Offset()));
+
+    std::cout << "Wrote " << output << ": " << segments.size() << " processes, " << threadCount << " threads, "
+        << eventCount << " events, " << dropped << " dropped records" << std::endl;
+
+    if (droppedArgs > 0) {
+        std::cout << droppedArgs << " event arguments were dropped, shared memory records do not carry them" << std::endl;
+    }
+
+    if (fallbackThreads > 0) {
+        std::cout << fallbackThreads << " threads found no free ring and were not collected, raise maxThreads of Profiler::EnableSharedMemory" << std::endl;
+    }
+}
@@ -3,19 +3,39 @@
 #ifndef PERFORMAN_H
 #define PERFORMAN_H
 
+#include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <cstring>
 #include <functional>
 #include <mutex>
+#include <new>
 #include <ratio>
 #include <vector>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <string>
+#include <string_view>
 
 ////////////////////////////////// API //////////////////////////////////
 
-#define PM_THREAD(name) Performan::SoftPtr<Performan::Thread> pmThread = Performan::Profiler::GetInstance()->AddThread(name);
-#define PM_SCOPED_FRAME() Performan::FrameScope pmFrameScope(pmThread);
-#define PM_SCOPED_EVENT(name) Performan::EventScope pmEventScope(pmThread, name);
+// PM_THREAD is optional, it names the calling thread. Unnamed threads are registered on first use.
+#define PM_THREAD(name) [[maybe_unused]] Performan::SoftPtr<Performan::Thread> pmThread = Performan::Profiler::GetInstance()->AddThread(name);
+#define PM_SCOPED_FRAME() Performan::FrameScope pmFrameScope;
+// Intended sleep in the current frame, before the wait itself: PM_FRAME_WAIT(std::chrono::milliseconds(13))
+#define PM_FRAME_WAIT(duration) Performan::FrameWaitScope pmFrameWaitScope(duration);
+#define PM_SCOPED_EVENT(name) Performan::EventScope pmEventScope(name);
+#define PM_SCOPED_EVENT_CATEGORY(name, category) Performan::EventScope pmEventScope(name, category);
+// Key / value pairs: PM_SCOPED_EVENT_ARGS("LoadAsset", "size", size, "asset", assetName)
+// Arguments are only kept by in process captures, threads writing to shared memory count them as dropped.
+#define PM_SCOPED_EVENT_ARGS(name, ...) Performan::EventScope pmEventScope(name); pmEventScope.AddArgs(__VA_ARGS__);
+// Hot call sites: PM_SCOPED_EVENT_SAMPLED("UpdateEntity", Performan::SamplingPolicy::OneIn(64))
+#define PM_SCOPED_EVENT_SAMPLED(name, policy) \
+    static const Performan::SamplingPolicy pmSamplingPolicy = policy; \
+    static thread_local Performan::SamplingState pmSamplingState; \
+    Performan::EventScope pmEventScope(name, pmSamplingPolicy, pmSamplingState);
 
 namespace Performan {
 
@@ -76,11 +96,413 @@ do                                                                             \
         T* _ptr = nullptr;
     };
 
+    // Minimal lock for data almost always taken by a single thread. Copies get their own unlocked lock.
+    struct SpinLock
+    {
+        SpinLock() = default;
+        SpinLock(const SpinLock&) {}
+        SpinLock& operator=(const SpinLock&) { return *this; }
+
+        void Lock()
+        {
+            while (_locked.exchange(true, std::memory_order_acquire))
+            {
+                while (_locked.load(std::memory_order_relaxed)) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        void Unlock() { _locked.store(false, std::memory_order_release); }
+
+        std::atomic<bool> _locked{ false };
+    };
+
     ////////////////////////////////// Profiler //////////////////////////////////
 
+    // Event categories are bits of a capture filter mask, user categories start at UserCategory
+    using CategoryMask = uint32_t;
+
+    enum : CategoryMask {
+        DefaultCategory = 1u << 0,
+        UserCategory = 1u << 1,
+        AllCategories = 0xFFFFFFFFu
+    };
+
     using PortableNano = std::chrono::duration<int64_t, std::nano>;
     using PortableTimePoint = std::chrono::time_point<std::chrono::steady_clock, PortableNano>;
 
+    ////////////////////////////////// Hardware Counters //////////////////////////////////
+
+    struct CounterValues {
+        uint64_t _cycles = 0;
+        uint64_t _instructions = 0;
+        uint64_t _llcMisses = 0;
+        uint64_t _branchMisses = 0;
+
+        CounterValues operator-(const CounterValues& rhs) const;
+        CounterValues operator*(uint64_t factor) const;
+        CounterValues& operator+=(const CounterValues& rhs);
+
+        template <class Stream>
+        void Serialize(Stream& stream);
+    };
+
+    // Per thread perf_event group (cycles, instructions, LLC misses, branch mispredicts).
+    // Reads go through rdpmc when the kernel allows it, otherwise through a group read().
+    // When counters are unavailable (non Linux, no PMU, paranoid settings), IsValid() is false.
+    struct HardwareCounters {
+        enum {
+            Cycles,
+            Instructions,
+            LlcMisses,
+            BranchMisses,
+            Count
+        };
+
+        // Must be called from the thread to measure
+        bool Open();
+        void Close();
+
+        bool IsValid() const { return _fds[Cycles] >= 0; }
+        CounterValues Read() const;
+
+        int _fds[Count] = { -1, -1, -1, -1 };
+        void* _pages[Count] = {};
+        bool _rdpmc = false;
+    };
+
+    ////////////////////////////////// Shared Memory //////////////////////////////////
+
+    // Fixed size record written by instrumented processes, names are truncated copies
+    struct SharedRecord {
+        enum Kind : uint32_t {
+            EventRecord,
+            FrameRecord
+        };
+
+        SharedRecord() = default;
+        SharedRecord(Kind kind, const char* name, PortableTimePoint start, PortableTimePoint end, uint32_t index = 0)
+            : _kind(kind)
+            , _index(index)
+            , _start(start.time_since_epoch().count())
+            , _end(end.time_since_epoch().count())
+        {
+            if (name) {
+                strncpy(_name, name, sizeof(_name) - 1);
+            }
+        }
+
+        // Frame records have no name, its bytes carry the gap and wait times of the frame instead
+        void SetFrameTimes(PortableNano gap, PortableNano waitIntended, PortableNano waitActual)
+        {
+            const int64_t times[3] = { gap.count(), waitIntended.count(), waitActual.count() };
+            memcpy(_name, times, sizeof(times));
+        }
+
+        void GetFrameTimes(PortableNano& gap, PortableNano& waitIntended, PortableNano& waitActual) const
+        {
+            int64_t times[3];
+            memcpy(times, _name, sizeof(times));
+            gap = PortableNano(times[0]);
+            waitIntended = PortableNano(times[1]);
+            waitActual = PortableNano(times[2]);
+        }
+
+        Kind _kind = EventRecord;
+        uint32_t _index = 0; // Frame index for frame records, sampling weight for event records
+        int64_t _start = 0;
+        int64_t _end = 0;
+        char _name[40] = {};
+    };
+
+    PERFORMAN_STATIC_ASSERT(sizeof(SharedRecord) == 64);
+
+    // Single producer (owning thread) / single consumer (collector) ring, records follow the header.
+    // Positions only grow, the record of a position lives at position % capacity.
+    // Rings of threads that exited or were removed are handed to new threads once the collector read all their records.
+    struct alignas(64) SharedRing {
+        enum State : uint32_t {
+            Free,
+            Used,
+            Claimed, // Being handed to a new thread, its name is written
+            Released // Its thread gave it up, records may still be pending
+        };
+
+        bool Push(const SharedRecord& record)
+        {
+            uint64_t write = _writePos.load(std::memory_order_relaxed);
+            if (write - _readPos.load(std::memory_order_acquire) >= _capacity) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            Records()[write % _capacity] = record;
+            _writePos.store(write + 1, std::memory_order_release);
+            return true;
+        }
+
+        SharedRecord* Records() { return reinterpret_cast<SharedRecord*>(this + 1); }
+
+        std::atomic<uint32_t> _state{ Free };
+        uint32_t _capacity = 0;
+        std::atomic<uint32_t> _generation{ 0 }; // Bumped each time the ring is handed to a thread
+        char _threadName[52] = {};
+        alignas(64) std::atomic<uint64_t> _writePos{ 0 };
+        std::atomic<uint64_t> _dropped{ 0 };
+        std::atomic<uint64_t> _droppedArgs{ 0 }; // Records have no room for event arguments
+        alignas(64) std::atomic<uint64_t> _readPos{ 0 };
+    };
+
+    PERFORMAN_STATIC_ASSERT(std::atomic<uint64_t>::is_always_lock_free);
+
+    struct SharedSegmentHeader {
+        enum : uint32_t {
+            Magic = 0x4D524550, // PERM
+            Version = 5
+        };
+
+        uint32_t _magic = 0; // Magic, written last by SharedMemorySegment::Create
+        uint32_t _version = Version;
+        int32_t _processId = 0;
+        uint32_t _ringCount = 0;
+        uint32_t _ringCapacity = 0;
+        // Steady / system clock pair sampled at creation, lets the collector align steady clocks
+        int64_t _steadyAtCreation = 0;
+        int64_t _systemAtCreation = 0;
+        std::atomic<uint32_t> _nextRing{ 0 };
+        std::atomic<uint32_t> _fallbackThreads{ 0 }; // Threads that found no ring and record in process only
+        // Calibrated by the process during its first capture, in nanoseconds
+        std::atomic<int64_t> _eventOverhead{ 0 };
+        std::atomic<int64_t> _frameOverhead{ 0 };
+    };
+
+    // POSIX shared memory segment holding one ring per thread. Threads registered while every ring is
+    // taken or still being drained keep recording in process, they are counted in the header.
+    struct SharedMemorySegment {
+        SharedMemorySegment() = default;
+        SharedMemorySegment(const SharedMemorySegment&) = delete;
+        void operator=(const SharedMemorySegment&) = delete;
+        ~SharedMemorySegment() { Close(false); }
+
+        // Instrumented process side
+        bool Create(const char* name, uint32_t ringCount, uint32_t ringCapacity);
+        SharedRing* AcquireRing(const char* threadName);
+        void ReleaseRing(SharedRing* ring);
+
+        // Collector side
+        bool Open(const char* name);
+
+        void Close(bool unlink);
+        bool IsValid() const { return _base != nullptr; }
+
+        SharedSegmentHeader* Header() const { return static_cast<SharedSegmentHeader*>(_base); }
+        SharedRing* Ring(uint32_t index) const;
+        size_t RingStride() const;
+
+        void* _base = nullptr;
+        size_t _size = 0;
+        std::string _name;
+    };
+
+    int32_t GetProcessId();
+
+    ////////////////////////////////// Statistics //////////////////////////////////
+
+    struct DurationStats {
+        uint64_t _count = 0;
+        PortableNano _mean{ 0 };
+        PortableNano _p50{ 0 };
+        PortableNano _p90{ 0 };
+        PortableNano _p99{ 0 };
+        PortableNano _max{ 0 };
+    };
+
+    // Log-linear (HDR style) duration histogram in nanoseconds: 16 sub buckets per power of two,
+    // values are known within 1/16th. Written by a single thread with relaxed atomics, read by any.
+    struct DurationHistogram {
+        enum : uint32_t {
+            SubBucketBits = 4,
+            SubBucketCount = 1u << SubBucketBits,
+            BucketCount = (64 - SubBucketBits + 1) * SubBucketCount
+        };
+
+        static uint32_t BucketIndex(uint64_t value);
+        // Middle of the values falling in the bucket
+        static uint64_t BucketValue(uint32_t index);
+
+        // Single writer, no read-modify-write needed
+        void Record(PortableNano duration)
+        {
+            uint64_t value = duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
+            std::atomic<uint64_t>& bucket = _buckets[BucketIndex(value)];
+            bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            _count.store(_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            _total.store(_total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            if (value > _max.load(std::memory_order_relaxed)) {
+                _max.store(value, std::memory_order_relaxed);
+            }
+        }
+
+        // Writer side as well
+        void Reset();
+
+        std::atomic<uint64_t> _buckets[BucketCount] = {};
+        std::atomic<uint64_t> _count{ 0 };
+        std::atomic<uint64_t> _total{ 0 };
+        std::atomic<uint64_t> _max{ 0 };
+    };
+
+    // Plain copy of merged histograms
+    struct HistogramSnapshot {
+        void Merge(const DurationHistogram& histogram);
+        void Merge(const HistogramSnapshot& snapshot);
+        DurationStats Stats() const;
+
+        uint64_t _buckets[DurationHistogram::BucketCount] = {};
+        uint64_t _count = 0;
+        uint64_t _total = 0;
+        uint64_t _max = 0;
+    };
+
+    // Per thread event name -> histogram table keyed by name pointer, only inserted into by the owning thread.
+    // Names past the capacity are not tracked.
+    struct ThreadStats {
+        enum : uint32_t {
+            Capacity = 256
+        };
+
+        ThreadStats(Allocator* allocator)
+            : _allocator(allocator) {}
+        ~ThreadStats();
+        ThreadStats(const ThreadStats&) = delete;
+        void operator=(const ThreadStats&) = delete;
+
+        DurationHistogram* Acquire(const char* name)
+        {
+            uint64_t hash = (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(name)) * 0x9E3779B97F4A7C15ull) >> 56;
+            for (uint32_t probe = 0; probe < Capacity; probe++)
+            {
+                uint32_t index = (static_cast<uint32_t>(hash) + probe) & (Capacity - 1);
+                const char* key = _names[index].load(std::memory_order_relaxed);
+                if (key == name) {
+                    return _histograms[index].load(std::memory_order_relaxed);
+                }
+                if (key == nullptr) {
+                    return Insert(index, name);
+                }
+            }
+            return nullptr;
+        }
+
+        DurationHistogram* AcquireFrames();
+
+        // Owning thread only, clears the histograms and moves them to the epoch
+        void Reset(uint32_t epoch);
+
+        // Merges every histogram whose name matches, safe from any thread
+        void Collect(const char* name, HistogramSnapshot& snapshot) const;
+
+        DurationHistogram* Insert(uint32_t index, const char* name);
+
+        std::atomic<const char*> _names[Capacity] = {}; // Published after the histogram
+        std::atomic<DurationHistogram*> _histograms[Capacity] = {};
+        std::atomic<DurationHistogram*> _frames{ nullptr };
+        std::atomic<uint32_t> _epoch{ 0 }; // Profiler::ResetStats count the histograms started from, published after clearing
+        Allocator* _allocator = nullptr;
+    };
+
+    // Strings written once per thread and referenced by index, for argument keys and string values
+    struct StringTable {
+        enum : uint32_t {
+            NullId = UINT32_MAX
+        };
+
+        uint32_t Add(const char* value);
+        uint32_t Find(const char* value) const;
+        const char* Get(uint32_t id) const { return id < _strings.size() ? _strings[id] : nullptr; }
+
+        template <class Stream>
+        void Serialize(Stream& stream);
+
+        std::vector<const char*> _strings;
+        std::unordered_map<std::string_view, uint32_t> _ids; // Only filled when writing
+    };
+
+    inline uint32_t StringTable::Add(const char* value)
+    {
+        if (value == nullptr) {
+            return NullId;
+        }
+
+        auto [itId, inserted] = _ids.emplace(value, static_cast<uint32_t>(_strings.size()));
+        if (inserted) {
+            _strings.push_back(value);
+        }
+        return itId->second;
+    }
+
+    inline uint32_t StringTable::Find(const char* value) const
+    {
+        if (value == nullptr) {
+            return NullId;
+        }
+
+        auto itId = _ids.find(value);
+        return itId != _ids.end() ? itId->second : NullId;
+    }
+
+    // Typed event argument. Keys and string values are stored as pointers and must outlive
+    // the capture: use literals or Profiler::InternString.
+    struct EventArg {
+        enum Type : uint8_t {
+            Int64,
+            Double,
+            String
+        };
+
+        EventArg() = default;
+        EventArg(const char* key, int64_t value)
+            : _key(key), _type(Int64), _int(value) {}
+        EventArg(const char* key, double value)
+            : _key(key), _type(Double), _double(value) {}
+        EventArg(const char* key, const char* value)
+            : _key(key), _type(String), _string(value) {}
+
+        template <class T>
+        static EventArg Make(const char* key, T value);
+
+        bool IsNumeric() const { return _type != String; }
+        double AsDouble() const { return _type == Int64 ? static_cast<double>(_int) : (_type == Double ? _double : 0.0); }
+
+        const char* _key = nullptr;
+        Type _type = Int64;
+        union {
+            int64_t _int = 0;
+            double _double;
+            const char* _string;
+        };
+
+        // Keys and string values are ids in the string table of the thread
+        template <class Stream>
+        void Serialize(Stream& stream, const StringTable& strings);
+    };
+
+    template <class T>
+    inline EventArg EventArg::Make(const char* key, T value)
+    {
+        if constexpr (std::is_floating_point_v<T>) {
+            return EventArg(key, static_cast<double>(value));
+        }
+        else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>) {
+            return EventArg(key, static_cast<int64_t>(value));
+        }
+        else {
+            PERFORMAN_STATIC_ASSERT_MESSAGE((std::is_convertible_v<T, const char*>), "Event arguments are int64, double or interned strings");
+            return EventArg(key, static_cast<const char*>(value));
+        }
+    }
+
     struct Event {
         Event() = default;
         Event(const char* name)
@@ -89,20 +511,30 @@ do                                                                             \
         const char* _name = nullptr;
         PortableTimePoint _start;
         PortableTimePoint _end;
+        CounterValues _counters; // Deltas over the scope, zero when counters are unavailable
+        uint32_t _argsOffset = 0; // First argument in the thread _args side buffer
+        uint32_t _argsCount = 0;
+        uint32_t _weight = 1; // Calls the event stands for, above 1 when its call site is sampled
 
+        // Counters are left out of threads that never captured any, see Thread::Serialize
         template <class Stream>
-        void Serialize(Stream& stream);
+        void Serialize(Stream& stream, bool counters = true);
     };
 
     struct Frame {
         PortableTimePoint _start;
         PortableTimePoint _end;
         uint64_t _frameIdx = 0;
+        PortableNano _gap{ 0 }; // Since the end of the previous frame of the thread
+        PortableNano _waitIntended{ 0 }; // PM_FRAME_WAIT in the frame
+        PortableNano _waitActual{ 0 };
 
         template <class Stream>
         void Serialize(Stream& stream);
     };
 
+    struct SamplingState;
+
     struct Thread {
 
         Thread() = default;
@@ -110,52 +542,202 @@ do                                                                             \
             : _name(name) {}
 
         const char* _name = nullptr;
+        int32_t _processId = 0;
         std::vector<Frame> _frames;
         std::vector<Event> _events;
+        std::vector<EventArg> _args; // Side buffer referenced by events
+        HardwareCounters _counters;
+        SharedRing* _ring = nullptr; // Records go to shared memory instead of the buffers above when set
+        ThreadStats* _stats = nullptr; // Live statistics, owned by the Profiler
+        // Capture the buffers above belong to and the last capture that wrote them, not serialized.
+        // Written under _bufferLock, the owning thread reads them without it.
+        uint32_t _captureEpoch = 0;
+        uint32_t _closedEpoch = 0;
+        // Held by the owning thread when appending to the buffers and by StopCapture when writing them
+        SpinLock _bufferLock;
+        uint64_t _frameCount = 0; // Frames begun while recording, numbers frames and resets sampling budgets, not serialized
+        // Sampled call sites of the capture, under _bufferLock. Calls they skipped since their last recorded event
+        // are added to it by StopCapture. Not serialized.
+        SamplingState* _samplers = nullptr;
+        PortableTimePoint _lastFrameEnd; // Of the last frame recorded in the current capture, for gaps, not serialized
+        Frame* _currentFrame = nullptr; // Innermost recording FrameScope, not serialized
+        // Scopes begun and not ended yet, written by the owning thread only, not serialized.
+        // Retired threads are not released while some are open.
+        uint32_t _openScopes = 0;
+
+        void OpenScope()
+        {
+            std::atomic_ref<uint32_t> openScopes(_openScopes);
+            openScopes.store(openScopes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        // Last access of the scope to the thread
+        void CloseScope()
+        {
+            std::atomic_ref<uint32_t> openScopes(_openScopes);
+            openScopes.store(openScopes.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+        }
 
         template <class Stream>
         void Serialize(Stream& stream);
     };
 
+    // First thing in a capture, followed by the threads
+    struct CaptureHeader {
+        enum : uint32_t {
+            Magic = 0x4D465250, // PRFM
+            Version = 1
+        };
+
+        bool IsValid() const { return _magic == Magic && _version == Version; }
+
+        uint32_t _magic = Magic;
+        uint32_t _version = Version;
+        // Time a nested scope adds to the scopes enclosing it, calibrated during the first capture
+        PortableNano _eventOverhead{ 0 };
+        PortableNano _frameOverhead{ 0 };
+
+        template <class Stream>
+        void Serialize(Stream& stream);
+    };
+
+    // Recording policy of a call site. Skipped calls are added to the weight of the last event recorded by the call site,
+    // or of the next one before any, so analysis scales counts and totals back up. Threads recording to shared memory
+    // lose the calls skipped after their last recorded event. Live statistics still see every call.
+    struct SamplingPolicy {
+        enum Mode : uint32_t {
+            Always,
+            OneInN,
+            // Records until the recorded time of the call site reaches the budget in the frame of the thread.
+            // Outside of frames, e.g. on job threads, the budget is per time window instead.
+            PerFrameBudget
+        };
+
+        static constexpr SamplingPolicy OneIn(uint32_t rate) { return SamplingPolicy{ OneInN, rate > 0 ? rate : 1, PortableNano(0), PortableNano(0) }; }
+        static constexpr SamplingPolicy BudgetPerFrame(PortableNano budget, PortableNano window = std::chrono::milliseconds(16)) { return SamplingPolicy{ PerFrameBudget, 1, budget, window }; }
+
+        Mode _mode = Always;
+        uint32_t _rate = 1;
+        PortableNano _budget{ 0 };
+        PortableNano _window{ 0 };
+    };
+
+    // Thread local state of a sampled call site, linked to the thread it samples on for the capture
+    struct SamplingState {
+        // False when the call is skipped, otherwise weight is the number of calls the recorded event stands for
+        bool Sample(const SamplingPolicy& policy, Thread& thread, uint32_t& weight);
+        // Charges the calls skipped so far to the last recorded event and starts a new budget period
+        void StartPeriod(Thread& thread);
+
+        static constexpr size_t NoEvent = SIZE_MAX;
+
+        std::atomic<uint32_t> _skipped{ 0 }; // Since the last recorded event, written by the owning thread only
+        Thread* _thread = nullptr;
+        uint32_t _captureEpoch = 0;
+        uint64_t _frameCount = 0;
+        PortableTimePoint _windowStart; // Of the budget period outside of frames
+        size_t _lastEvent = NoEvent; // Index in the thread events of the last recorded event, under the thread _bufferLock
+        PortableNano _spent{ 0 }; // Recorded time in the current period
+        SamplingState* _next = nullptr; // In the thread samplers
+    };
+
+    // Scopes check the capture state once at construction, a disabled scope records nothing.
+    // Disabled scopes only clear _thread, the state of an active scope is constructed by Begin.
     struct EventScope {
-        EventScope(Thread& thread, const char* name)
-            : _thread(&thread)
-            , _event(name)
-        {
-            _event._start = std::chrono::steady_clock::now();
-        }
+        EventScope(const char* name, CategoryMask category = DefaultCategory);
+        EventScope(const char* name, const SamplingPolicy& policy, SamplingState& state, CategoryMask category = DefaultCategory);
 
-        EventScope(SoftPtr<Thread> frame, const char* name)
-            : _thread(frame)
-            , _event(name)
-        {
-            _event._start = std::chrono::steady_clock::now();
-        }
+        EventScope(Thread& thread, const char* name, CategoryMask category = DefaultCategory)
+            : EventScope(SoftPtr<Thread>(&thread), name, category) {}
+
+        EventScope(SoftPtr<Thread> thread, const char* name, CategoryMask category = DefaultCategory);
 
         ~EventScope() {
-            _event._end = std::chrono::steady_clock::now();
-            _thread->_events.push_back(std::move(_event));
+            // Keep the disabled path inlined and branch only
+            if (_thread._ptr != nullptr) {
+                End();
+                _thread->CloseScope();
+            }
         }
 
+        // Out of line, keeps the recording code and its registers out of the disabled path
+        void Begin(SoftPtr<Thread> thread, const char* name, uint64_t active, uint32_t weight = 1, SamplingState* sampling = nullptr);
+        void End();
+
+        // All of the arguments under one buffer lock, a scope gets all or none of them
+        template <class T, class... Rest>
+        void AddArgs(const char* key, T value, Rest... rest);
+
+        template <class T, class... Rest>
+        static void PushArgs(std::vector<EventArg>& args, const char* key, T value, Rest... rest);
+
+        struct Active {
+            Event _event;
+            CounterValues _countersStart;
+            SamplingState* _sampling = nullptr; // Charged with the recorded duration, points at the recorded event
+            uint32_t _captureEpoch = 0; // Capture the scope began in, it records nothing into later ones
+            bool _recording = false; // Captured
+            bool _stats = false; // Feeds live statistics
+        };
+
         SoftPtr<Thread> _thread;
-        Event _event;
+        union {
+            Active _active; // Only valid once _thread is set
+        };
     };
 
+    PERFORMAN_STATIC_ASSERT(std::is_trivially_destructible_v<EventScope::Active>);
+
     struct FrameScope {
-        FrameScope(SoftPtr<Thread> thread)
-            :_thread(thread)
-        {
-            _frame._start = std::chrono::steady_clock::now();
-        }
+        FrameScope();
+        FrameScope(SoftPtr<Thread> thread);
 
         ~FrameScope()
         {
-            _frame._end = std::chrono::steady_clock::now();
-            _thread->_frames.push_back(_frame);
+            if (_thread._ptr != nullptr) {
+                End();
+                _thread->CloseScope();
+            }
         }
 
+        void Begin(SoftPtr<Thread> thread, uint64_t active);
+        void End();
+
+        struct Active {
+            Frame _frame;
+            Frame* _previous = nullptr; // Enclosing frame, current again once this one ends
+            uint32_t _captureEpoch = 0; // Capture the scope began in, it records nothing into later ones
+            bool _recording = false;
+            bool _stats = false;
+        };
+
         SoftPtr<Thread> _thread;
-        Frame _frame;
+        union {
+            Active _active; // Only valid once _thread is set
+        };
+    };
+
+    PERFORMAN_STATIC_ASSERT(std::is_trivially_destructible_v<FrameScope::Active>);
+
+    // Times the wait as a FrameWait event and adds intended and actual wait times to the current frame,
+    // oversleep is the wake up latency of the thread. Recorded in every category like frames, a capture
+    // filtered to user categories keeps the waits of its frames.
+    struct FrameWaitScope {
+        FrameWaitScope(PortableNano intended)
+            : _event("FrameWait", AllCategories)
+            , _intended(intended) {}
+
+        ~FrameWaitScope()
+        {
+            if (_event._thread._ptr != nullptr && _event._active._recording && _event._thread->_currentFrame)
+            {
+                _event._thread->_currentFrame->_waitIntended += _intended;
+                _event._thread->_currentFrame->_waitActual += std::chrono::steady_clock::now() - _event._active._event._start;
+            }
+        }
+
+        EventScope _event;
+        PortableNano _intended;
     };
 
     using SaveFunction = std::function<void(uint8_t*, uint32_t)>;
@@ -171,13 +753,70 @@ do                                                                             \
         void SetAllocator(Allocator* allocator);
         Allocator* GetAllocator() const;
 
+        // Registers the calling thread, replacing its previous registration if any.
+        // Lock free, registered threads are only released by StopCapture once retired.
         SoftPtr<Thread> AddThread(const char* name);
+        // Retires the thread, its data is kept until the next StopCapture. Lock free, the thread must still
+        // be registered. From another thread, the removed thread registers again on its next scope.
         void RemoveThread(SoftPtr<Thread> thread);
 
+        // Thread registered for the calling thread, registers it on first use
+        static Thread* GetCurrentThread();
+
+        // Opens hardware counters on threads added afterwards
+        void SetHardwareCountersEnabled(bool enabled) { _hardwareCountersEnabled = enabled; }
+        bool HardwareCountersEnabled() const { return _hardwareCountersEnabled; }
+
         void SetSaveCallback(SaveFunction fct) { _saveFct = fct; }
 
-        void StartCapture() {}
+        // Start / stop are lock free and picked up by the next scope on every thread.
+        // StopCapture writes the threads that recorded during the capture to the save callback.
+        // The first capture also measures the instrumentation overhead in the background, StopCapture waits for it
+        // and writes it in the capture header. Later captures reuse it until the recording path changes.
+        void StartCapture(CategoryMask categories = AllCategories);
         void StopCapture();
+        // Complete once StopCapture returned
+        const CaptureHeader& GetCaptureHeader() const { return _captureHeader; }
+
+        // Live duration statistics per event name and for frames, updated without any capture running.
+        // Recording threads update their own histograms lock free, queries merge them.
+        void EnableStats(CategoryMask categories = AllCategories);
+        void DisableStats();
+        DurationStats QueryStats(const char* name);
+        DurationStats QueryFrameStats();
+        // Starts the statistics over, e.g. per level or per time window. Recording threads clear their own
+        // histograms on their next scope, queries ignore histograms that were not cleared yet.
+        void ResetStats();
+
+        enum : uint64_t {
+            CaptureBits = 0x00000000FFFFFFFFull,
+            StatsBits = 0xFFFFFFFF00000000ull
+        };
+
+        // Capture and stats bits enabled for the categories, one relaxed load, safe to call without an instance
+        static uint64_t ActiveState(CategoryMask categories)
+        {
+            return _activeState.load(std::memory_order_relaxed) & (categories | (static_cast<uint64_t>(categories) << 32));
+        }
+
+        static bool IsCapturing(CategoryMask categories = AllCategories) { return (ActiveState(categories) & CaptureBits) != 0; }
+
+        // Drops the thread buffers when they belong to a previous capture
+        static void SyncCaptureEpoch(Thread& thread);
+        // Clears the thread statistics when they predate the last ResetStats
+        static void SyncStatsEpoch(ThreadStats& stats);
+        // Adds the calls skipped by the sampled call sites of the thread to their last recorded event, under _bufferLock
+        static void FlushSkippedCalls(Thread& thread);
+        // Locks the buffers to append records of the capture epoch to them, false when StopCapture
+        // already wrote them or when they belong to another capture
+        static bool LockBuffers(Thread& thread, uint32_t epoch);
+
+        // Stable copy of a dynamic string, to use as an event argument without formatting names
+        const char* InternString(const char* value);
+
+        // Threads registered afterwards record in rings of the shared memory segment "/<prefix>.<pid>",
+        // drained by performan_collector. The segment outlives the process until the collector unlinks it.
+        bool EnableSharedMemory(const char* prefix = "performan", uint32_t maxThreads = 64, uint32_t ringCapacity = 16384);
 
     private:
         Profiler() = default;
@@ -186,23 +825,551 @@ do                                                                             \
         void operator=(const Profiler&) = delete;
 
     private:
-        std::vector<Thread*> _threads;
-        mutable std::mutex _threadsMtx;
+        struct ThreadEntry {
+            ThreadEntry(const char* name)
+                : _thread(name) {}
+
+            Thread _thread;
+            ThreadEntry* _next = nullptr;
+            std::atomic<bool> _retired{ false };
+            // Still referenced by the thread_local of its thread, which may keep using it after a RemoveThread
+            // from another thread. Released entries are retired, no longer owned and have no open scope.
+            std::atomic<bool> _owned{ true };
+        };
+
+        // Only used as a thread_local, zero initialized
+        struct ThreadLocalState {
+            ~ThreadLocalState(); // Retires the thread and gives its entry up on exit
+
+            ThreadEntry* _entry;
+            uint32_t _generation;
+        };
+
+        static ThreadEntry* CreateThreadEntry(const char* name);
+        void DeleteThreadEntry(ThreadEntry* entry);
+        static Thread* RegisterCurrentThread(const char* name);
+        // The calling thread gives its own entry up, its shared memory ring goes back to the segment
+        static void RetireOwnEntry(ThreadEntry* entry);
+        void ReleaseRetiredThreads();
+        static void UpdateActiveState(uint64_t keepBits, uint64_t setBits);
+        static bool IsStatsCurrent(const ThreadStats* stats);
+        // Starts measuring the overhead unless it was measured on the same recording path already
+        void CalibrateOverhead(CategoryMask categories);
+        void WaitForCalibration();
+
+    private:
+        // Append only intrusive list, pushed at head with a CAS
+        std::atomic<ThreadEntry*> _threads{ nullptr };
+        // Serializes registry walks against the release of retired threads, never taken when recording
+        std::mutex _flushMtx;
+
+        std::unordered_set<std::string> _internedStrings;
+        std::mutex _internMtx;
+
+        SharedMemorySegment _sharedMemory;
+
+        // Statistics of released threads, under _flushMtx
+        std::unordered_map<std::string, HistogramSnapshot> _retiredStats;
+        HistogramSnapshot _retiredFrameStats;
 
         SaveFunction _saveFct;
+        CaptureHeader _captureHeader;
+
+        // Records through the macros while the capture that started it runs
+        std::thread _calibration;
+        bool _calibrated = false;
+        // Recording path the overhead was measured on
+        bool _calibratedSharedMemory = false;
+        bool _calibratedCounters = false;
 
         Allocator* _allocator = nullptr;
+        bool _hardwareCountersEnabled = false;
 
         inline static Profiler* _instance = nullptr;
+        // Bumped on instance creation / destruction, invalidates registrations of previous instances
+        inline static std::atomic<uint32_t> _generation{ 0 };
+        inline static thread_local ThreadLocalState _threadLocal;
+
+        // Captured categories in the low 32 bits, categories feeding statistics in the high 32 bits
+        inline static std::atomic<uint64_t> _activeState{ 0 };
+        inline static std::atomic<uint32_t> _captureEpoch{ 0 };
+        inline static std::atomic<uint32_t> _statsEpoch{ 0 };
+    };
+
+    inline Thread* Profiler::GetCurrentThread()
+    {
+        if (_threadLocal._generation != _generation.load(std::memory_order_relaxed) || _threadLocal._entry->_retired.load(std::memory_order_relaxed)) {
+            return RegisterCurrentThread(nullptr);
+        }
+        return &_threadLocal._entry->_thread;
+    }
+
+    inline void Profiler::SyncCaptureEpoch(Thread& thread)
+    {
+        uint32_t epoch = _captureEpoch.load(std::memory_order_relaxed);
+        if (thread._captureEpoch != epoch)
+        {
+            thread._bufferLock.Lock();
+            thread._events.clear();
+            thread._frames.clear();
+            thread._args.clear();
+            thread._samplers = nullptr;
+            thread._lastFrameEnd = PortableTimePoint();
+            thread._captureEpoch = epoch;
+            thread._bufferLock.Unlock();
+        }
+    }
+
+    inline void Profiler::SyncStatsEpoch(ThreadStats& stats)
+    {
+        uint32_t epoch = _statsEpoch.load(std::memory_order_relaxed);
+        if (stats._epoch.load(std::memory_order_relaxed) != epoch) {
+            stats.Reset(epoch);
+        }
+    }
+
+    inline bool Profiler::LockBuffers(Thread& thread, uint32_t epoch)
+    {
+        thread._bufferLock.Lock();
+        if (thread._captureEpoch != epoch || thread._closedEpoch == epoch)
+        {
+            // Scope opened before the capture stopped
+            thread._bufferLock.Unlock();
+            return false;
+        }
+        return true;
+    }
+
+    inline EventScope::EventScope(const char* name, CategoryMask category)
+    {
+        if (uint64_t active = Profiler::ActiveState(category)) {
+            Begin(Profiler::GetCurrentThread(), name, active);
+        }
+    }
+
+    inline bool SamplingState::Sample(const SamplingPolicy& policy, Thread& thread, uint32_t& weight)
+    {
+        // Calls skipped during a previous capture or on a previous registration are not carried over
+        if (_captureEpoch != thread._captureEpoch || _thread != &thread)
+        {
+            _thread = &thread;
+            _captureEpoch = thread._captureEpoch;
+            _skipped.store(0, std::memory_order_relaxed);
+            _frameCount = thread._frameCount;
+            _windowStart = std::chrono::steady_clock::now();
+            _lastEvent = NoEvent;
+            _spent = PortableNano(0);
+
+            thread._bufferLock.Lock();
+            _next = thread._samplers;
+            thread._samplers = this;
+            thread._bufferLock.Unlock();
+        }
+
+        switch (policy._mode)
+        {
+        case SamplingPolicy::OneInN:
+        {
+            uint32_t skipped = _skipped.load(std::memory_order_relaxed);
+            if (skipped + 1 < policy._rate)
+            {
+                _skipped.store(skipped + 1, std::memory_order_relaxed);
+                return false;
+            }
+            break;
+        }
+        case SamplingPolicy::PerFrameBudget:
+            if (_frameCount != thread._frameCount) {
+                StartPeriod(thread);
+            }
+            else if (_spent >= policy._budget && thread._currentFrame == nullptr)
+            {
+                // Only looks at the clock once the budget is spent
+                PortableTimePoint now = std::chrono::steady_clock::now();
+                if (now - _windowStart >= policy._window)
+                {
+                    StartPeriod(thread);
+                    _windowStart = now;
+                }
+            }
+            if (_spent >= policy._budget)
+            {
+                _skipped.store(_skipped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+
+        // Skipped before any recorded event of the capture, or when they could not be charged to it
+        weight = _skipped.load(std::memory_order_relaxed) + 1;
+        _skipped.store(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    inline void SamplingState::StartPeriod(Thread& thread)
+    {
+        // Stays pending for the next recorded event when the last one went to a shared memory ring
+        if (_skipped.load(std::memory_order_relaxed) > 0 && _lastEvent != NoEvent && Profiler::LockBuffers(thread, _captureEpoch))
+        {
+            if (_lastEvent < thread._events.size())
+            {
+                thread._events[_lastEvent]._weight += _skipped.load(std::memory_order_relaxed);
+                _skipped.store(0, std::memory_order_relaxed);
+            }
+            thread._bufferLock.Unlock();
+        }
+
+        _frameCount = thread._frameCount;
+        _spent = PortableNano(0);
+    }
+
+    inline EventScope::EventScope(const char* name, const SamplingPolicy& policy, SamplingState& state, CategoryMask category)
+    {
+        if (uint64_t active = Profiler::ActiveState(category))
+        {
+            Thread* thread = Profiler::GetCurrentThread();
+            uint32_t weight = 1;
+            SamplingState* sampling = nullptr;
+
+            if (active & Profiler::CaptureBits)
+            {
+                Profiler::SyncCaptureEpoch(*thread);
+                if (!state.Sample(policy, *thread, weight)) {
+                    active &= ~static_cast<uint64_t>(Profiler::CaptureBits);
+                }
+                else if (policy._mode != SamplingPolicy::Always) {
+                    sampling = &state;
+                }
+            }
+
+            if (active) {
+                Begin(thread, name, active, weight, sampling);
+            }
+        }
+    }
+
+    inline EventScope::EventScope(SoftPtr<Thread> thread, const char* name, CategoryMask category)
+    {
+        if (uint64_t active = Profiler::ActiveState(category)) {
+            Begin(thread, name, active);
+        }
+    }
+
+    inline void EventScope::End()
+    {
+        Event& evt = _active._event;
+        evt._end = std::chrono::steady_clock::now();
+        if (_active._stats && _thread->_stats)
+        {
+            Profiler::SyncStatsEpoch(*_thread->_stats);
+            if (DurationHistogram* histogram = _thread->_stats->Acquire(evt._name)) {
+                histogram->Record(evt._end - evt._start);
+            }
+        }
+
+        if (!_active._recording) {
+            return;
+        }
+
+        if (_active._sampling) {
+            _active._sampling->_spent += evt._end - evt._start;
+        }
+
+        if (_thread->_ring) {
+            _thread->_ring->Push(SharedRecord(SharedRecord::EventRecord, evt._name, evt._start, evt._end, evt._weight));
+            return;
+        }
+
+        if (_thread->_counters.IsValid()) {
+            evt._counters = _thread->_counters.Read() - _active._countersStart;
+        }
+
+        if (Profiler::LockBuffers(*_thread, _active._captureEpoch))
+        {
+            if (_active._sampling) {
+                _active._sampling->_lastEvent = _thread->_events.size();
+            }
+            _thread->_events.push_back(std::move(evt));
+            _thread->_bufferLock.Unlock();
+        }
+    }
+
+    template <class T, class... Rest>
+    inline void EventScope::AddArgs(const char* key, T value, Rest... rest)
+    {
+        PERFORMAN_STATIC_ASSERT_MESSAGE(sizeof...(Rest) % 2 == 0, "Event arguments are key / value pairs");
+
+        if (_thread._ptr == nullptr || !_active._recording) {
+            return;
+        }
+
+        // Arguments are not forwarded to shared memory rings
+        if (_thread->_ring)
+        {
+            _thread->_ring->_droppedArgs.fetch_add(1 + sizeof...(Rest) / 2, std::memory_order_relaxed);
+            return;
+        }
+
+        if (!Profiler::LockBuffers(*_thread, _active._captureEpoch)) {
+            return;
+        }
+
+        // Nested scopes may have pushed arguments since this scope began or last added some
+        Event& evt = _active._event;
+        std::vector<EventArg>& args = _thread->_args;
+        if (evt._argsCount == 0) {
+            evt._argsOffset = static_cast<uint32_t>(args.size());
+        }
+        else if (evt._argsOffset + evt._argsCount != args.size())
+        {
+            // Keep the arguments of the event contiguous, the previous copies are left unreferenced
+            uint32_t offset = static_cast<uint32_t>(args.size());
+            for (uint32_t index = 0; index < evt._argsCount; index++) {
+                args.push_back(args[evt._argsOffset + index]);
+            }
+            evt._argsOffset = offset;
+        }
+
+        PushArgs(args, key, value, rest...);
+        _thread->_bufferLock.Unlock();
+        evt._argsCount += 1 + sizeof...(Rest) / 2;
+    }
+
+    template <class T, class... Rest>
+    inline void EventScope::PushArgs(std::vector<EventArg>& args, const char* key, T value, Rest... rest)
+    {
+        args.push_back(EventArg::Make(key, value));
+
+        if constexpr (sizeof...(Rest) > 0) {
+            PushArgs(args, rest...);
+        }
+    }
+
+    inline FrameScope::FrameScope()
+    {
+        if (uint64_t active = Profiler::ActiveState(AllCategories)) {
+            Begin(Profiler::GetCurrentThread(), active);
+        }
+    }
+
+    inline FrameScope::FrameScope(SoftPtr<Thread> thread)
+    {
+        if (uint64_t active = Profiler::ActiveState(AllCategories)) {
+            Begin(thread, active);
+        }
+    }
+
+    inline void FrameScope::End()
+    {
+        Frame& frame = _active._frame;
+        frame._end = std::chrono::steady_clock::now();
+        if (_active._stats && _thread->_stats)
+        {
+            Profiler::SyncStatsEpoch(*_thread->_stats);
+            if (DurationHistogram* histogram = _thread->_stats->AcquireFrames()) {
+                histogram->Record(frame._end - frame._start);
+            }
+        }
+
+        if (!_active._recording) {
+            return;
+        }
+
+        if (_thread->_currentFrame == &frame) {
+            _thread->_currentFrame = _active._previous;
+        }
+
+        // Frame of a previous capture, its buffers were dropped
+        if (_thread->_captureEpoch != _active._captureEpoch) {
+            return;
+        }
+        _thread->_lastFrameEnd = frame._end;
+
+        if (_thread->_ring)
+        {
+            SharedRecord record(SharedRecord::FrameRecord, nullptr, frame._start, frame._end, static_cast<uint32_t>(frame._frameIdx));
+            record.SetFrameTimes(frame._gap, frame._waitIntended, frame._waitActual);
+            _thread->_ring->Push(record);
+            return;
+        }
+
+        if (Profiler::LockBuffers(*_thread, _active._captureEpoch))
+        {
+            _thread->_frames.push_back(frame);
+            _thread->_bufferLock.Unlock();
+        }
+    }
+
+    ////////////////////////////////// Collector //////////////////////////////////
+
+    // Collector side view of a process segment, drains its rings into Threads
+    class SharedMemoryReader {
+    public:
+        bool Open(const char* name);
+        // Unlink removes the segment, only do it once the process is gone and everything was drained
+        void Close(bool unlink);
+
+        int32_t ProcessId() const;
+        bool IsProcessAlive() const;
+
+        // Moves available records into the per ring threads, returns the number of records drained.
+        // A ring handed to a new thread starts a new Thread. Timestamps are aligned on the steady clock of the reader.
+        size_t Drain();
+
+        std::vector<Thread>& Threads() { return _threads; }
+        uint64_t Dropped() const;
+        uint64_t DroppedArgs() const;
+        uint32_t FallbackThreads() const;
+        PortableNano EventOverhead() const;
+        PortableNano FrameOverhead() const;
+
+    private:
+        const char* Intern(const char* value, size_t maxLength);
+
+    private:
+        SharedMemorySegment _segment;
+        std::vector<Thread> _threads; // One per thread that owned a ring
+        std::vector<size_t> _ringThreads; // Index in _threads of the current owner of each ring
+        std::vector<uint32_t> _ringGenerations; // Generation of that owner, 0 before the first
+        std::unordered_set<std::string> _strings;
+        PortableNano _clockOffset{ 0 };
+    };
+
+    ////////////////////////////////// Analysis //////////////////////////////////
+
+    struct EventStats {
+        const char* _name = nullptr;
+        uint64_t _calls = 0; // Estimated from sampling weights
+        uint64_t _samples = 0; // Recorded events
+        PortableNano _total{ 0 };
+        CounterValues _counters;
+
+        double InstructionsPerCycle() const;
+        double LlcMissesPerCall() const;
+        double BranchMissesPerCall() const;
+    };
+
+    // Aggregates events by name over every thread, sorted by total time (descending)
+    std::vector<EventStats> AnalyzeEvents(const std::vector<Thread>& threads);
+
+    // Argument of an event by key, nullptr when missing
+    const EventArg* FindEventArg(const Thread& thread, const Event& evt, const char* key);
+
+    struct ArgBucketStats {
+        double _bucket = 0.0; // Lower bound of the bucket
+        uint64_t _count = 0; // Estimated from sampling weights, percentiles use the recorded events
+        PortableNano _p50{ 0 };
+        PortableNano _p99{ 0 };
+        PortableNano _max{ 0 };
+    };
+
+    // Durations of the events named eventName grouped in buckets of bucketWidth over a numeric argument,
+    // e.g. p99 of LoadAsset per size bucket. Events without the argument are ignored.
+    std::vector<ArgBucketStats> AnalyzeEventsByArg(const std::vector<Thread>& threads, const char* eventName, const char* key, double bucketWidth);
+
+    // Shortens events and frames by the calibrated overhead of the events and frames nested in them, so inclusive
+    // durations of deep hierarchies are not inflated by instrumentation. Start times are unchanged.
+    void CompensateOverhead(std::vector<Thread>& threads, const CaptureHeader& header);
+
+    struct FrameCulprit {
+        const char* _name = nullptr;
+        PortableNano _excess{ 0 }; // Time of the event in the frame above its median per frame
+    };
+
+    struct LateFrame {
+        uint64_t _frameIdx = 0;
+        PortableNano _frameTime{ 0 };
+        PortableNano _oversleep{ 0 };
+        std::vector<FrameCulprit> _culprits; // Largest excess first
     };
 
+    struct FramePacingStats {
+        uint64_t _frames = 0;
+        // Frame times run from the end of the previous frame to the end of the frame, gaps included
+        PortableNano _mean{ 0 };
+        PortableNano _p99{ 0 };
+        PortableNano _max{ 0 };
+        double _variance = 0.0; // In ms^2
+        uint64_t _droppedFrames = 0; // Target periods missed by late frames
+        PortableNano _meanOversleep{ 0 }; // Over frames with a PM_FRAME_WAIT
+        PortableNano _maxOversleep{ 0 };
+        std::vector<LateFrame> _lateFrames; // Frames longer than the target
+    };
+
+    // Pacing of the frames of a thread against a target frame time (e.g. 16.67 ms for 60 Hz)
+    FramePacingStats AnalyzeFramePacing(const Thread& thread, PortableNano targetFrameTime, size_t maxCulprits = 3);
+
+    ////////////////////////////////// Columnar //////////////////////////////////
+
+    // Structure of arrays copy of a thread for bulk scans, events sorted by start.
+    // Times are nanoseconds since the steady clock epoch.
+    struct ColumnarThread {
+        const char* _name = nullptr;
+        int32_t _processId = 0;
+        std::vector<int64_t> _starts;
+        std::vector<int64_t> _durations;
+        std::vector<uint32_t> _nameIds; // Index in ColumnarCapture::_names
+        std::vector<uint32_t> _weights; // Sampling weight, each kept event stands for that many calls
+        std::vector<int64_t> _frameStarts;
+        std::vector<int64_t> _frameEnds;
+    };
+
+    struct ColumnarCapture {
+        enum : uint32_t {
+            InvalidNameId = UINT32_MAX
+        };
+
+        // Names point into the source threads, keep them alive
+        static ColumnarCapture FromThreads(const std::vector<Thread>& threads);
+
+        uint32_t FindName(const char* name) const;
+
+        std::vector<const char*> _names; // One entry per distinct name
+        std::vector<ColumnarThread> _threads;
+    };
+
+    // Kernels below are dispatched at runtime: AVX2 on x86, NEON on arm64, scalar otherwise
+    enum SimdLevel {
+        SimdScalar,
+        SimdAvx2,
+        SimdNeon
+    };
+
+    SimdLevel GetSimdLevel();
+    // Returns false and keeps the current level when the cpu does not support the requested one
+    bool SetSimdLevel(SimdLevel level);
+
+    void ComputeDurations(const int64_t* starts, const int64_t* ends, int64_t* durations, size_t count);
+
+    // Weights below are the sampling weights of the events (ColumnarThread::_weights), nullptr counts each event once
+
+    // Matching count and total duration of the events with nameId, scaled by the weights
+    void SumDurationsByName(const uint32_t* nameIds, const int64_t* durations, const uint32_t* weights, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total);
+
+    // Appends indices of the events with nameId
+    void FilterByName(const uint32_t* nameIds, size_t count, uint32_t nameId, std::vector<uint32_t>& indices);
+
+    // bins[min(duration / binWidth, binCount - 1)] += weight, negative durations land in the first bin
+    void HistogramDurations(const int64_t* durations, const uint32_t* weights, size_t count, int64_t binWidth, uint64_t* bins, size_t binCount);
+
+    // totals[frame] = weighted sum of the durations of the events with nameId (any with InvalidNameId) starting in
+    // [frameStarts[frame], frameEnds[frame]). Event starts must be sorted.
+    void SumDurationsPerFrame(const int64_t* starts, const int64_t* durations, const uint32_t* weights, const uint32_t* nameIds, size_t count,
+        const int64_t* frameStarts, const int64_t* frameEnds, size_t frameCount, uint32_t nameId, int64_t* totals);
+
     ////////////////////////////////// Serialization //////////////////////////////////
 
     template <class Stream>
     void Serialize(Stream& stream, const char*& value);
 
-    template <class Stream, class T>
-    void SerializeVector(Stream& stream, std::vector<T>& values);
+    template <class Stream>
+    void Serialize(Stream& stream, PortableNano& value);
+
+    // Extra arguments are forwarded to the Serialize of every element
+    template <class Stream, class T, class... Args>
+    void SerializeVector(Stream& stream, std::vector<T>& values, const Args&... args);
 
     class Stream {
     public:
@@ -264,8 +1431,107 @@ do                                                                             \
     inline void Thread::Serialize(Stream& stream)
     {
         Performan::Serialize(stream, _name);
-        Performan::SerializeVector(stream, _events);
+        PERFORMAN_SERIALIZE(stream, &_processId, sizeof(int32_t));
+
+        // 32 bytes per event, only written when some event captured counters
+        uint8_t counters = 0;
+        if constexpr (Stream::IsWriting)
+        {
+            for (const Event& evt : _events)
+            {
+                if (evt._counters._cycles || evt._counters._instructions || evt._counters._llcMisses || evt._counters._branchMisses)
+                {
+                    counters = 1;
+                    break;
+                }
+            }
+        }
+
+        PERFORMAN_SERIALIZE(stream, &counters, sizeof(uint8_t));
+        Performan::SerializeVector(stream, _events, counters != 0);
         Performan::SerializeVector(stream, _frames);
+
+        StringTable strings;
+        if constexpr (Stream::IsWriting)
+        {
+            for (const EventArg& arg : _args)
+            {
+                strings.Add(arg._key);
+                if (arg._type == EventArg::String) {
+                    strings.Add(arg._string);
+                }
+            }
+        }
+
+        strings.Serialize(stream);
+        Performan::SerializeVector(stream, _args, strings);
+    }
+
+    template<class Stream>
+    inline void StringTable::Serialize(Stream& stream)
+    {
+        uint32_t size = static_cast<uint32_t>(_strings.size());
+        PERFORMAN_SERIALIZE(stream, &size, sizeof(uint32_t));
+
+        if constexpr (Stream::IsReading) {
+            _strings.resize(size);
+        }
+
+        for (const char*& value : _strings) {
+            Performan::Serialize(stream, value);
+        }
+    }
+
+    template<class Stream>
+    inline void CaptureHeader::Serialize(Stream& stream)
+    {
+        int64_t eventOverhead = _eventOverhead.count();
+        int64_t frameOverhead = _frameOverhead.count();
+
+        PERFORMAN_SERIALIZE(stream, &_magic, sizeof(uint32_t));
+        PERFORMAN_SERIALIZE(stream, &_version, sizeof(uint32_t));
+        PERFORMAN_SERIALIZE(stream, &eventOverhead, sizeof(int64_t));
+        PERFORMAN_SERIALIZE(stream, &frameOverhead, sizeof(int64_t));
+
+        if constexpr (Stream::IsReading)
+        {
+            _eventOverhead = PortableNano(eventOverhead);
+            _frameOverhead = PortableNano(frameOverhead);
+        }
+    }
+
+    template<class Stream>
+    inline void EventArg::Serialize(Stream& stream, const StringTable& strings)
+    {
+        // Key id, type tag then payload: 8 bytes for numbers, a string id for strings
+        uint32_t keyId = StringTable::NullId;
+        if constexpr (Stream::IsWriting) {
+            keyId = strings.Find(_key);
+        }
+
+        PERFORMAN_SERIALIZE(stream, &keyId, sizeof(uint32_t));
+        PERFORMAN_SERIALIZE(stream, &_type, sizeof(uint8_t));
+
+        if (_type == String)
+        {
+            uint32_t valueId = StringTable::NullId;
+            if constexpr (Stream::IsWriting) {
+                valueId = strings.Find(_string);
+            }
+
+            PERFORMAN_SERIALIZE(stream, &valueId, sizeof(uint32_t));
+
+            if constexpr (Stream::IsReading) {
+                _string = strings.Get(valueId);
+            }
+        }
+        else {
+            PERFORMAN_SERIALIZE(stream, &_int, sizeof(int64_t));
+        }
+
+        if constexpr (Stream::IsReading) {
+            _key = strings.Get(keyId);
+        }
     }
 
     template<class Stream>
@@ -283,6 +1549,9 @@ do                                                                             \
         PERFORMAN_SERIALIZE(stream, &startCount, sizeof(int64_t));
         PERFORMAN_SERIALIZE(stream, &endCount, sizeof(int64_t));
         PERFORMAN_SERIALIZE(stream, &_frameIdx, sizeof(uint64_t));
+        Performan::Serialize(stream, _gap);
+        Performan::Serialize(stream, _waitIntended);
+        Performan::Serialize(stream, _waitActual);
 
         if constexpr (Stream::IsReading)
         {
@@ -294,7 +1563,16 @@ do                                                                             \
     }
 
     template<class Stream>
-    inline void Event::Serialize(Stream& stream)
+    inline void CounterValues::Serialize(Stream& stream)
+    {
+        PERFORMAN_SERIALIZE(stream, &_cycles, sizeof(uint64_t));
+        PERFORMAN_SERIALIZE(stream, &_instructions, sizeof(uint64_t));
+        PERFORMAN_SERIALIZE(stream, &_llcMisses, sizeof(uint64_t));
+        PERFORMAN_SERIALIZE(stream, &_branchMisses, sizeof(uint64_t));
+    }
+
+    template<class Stream>
+    inline void Event::Serialize(Stream& stream, bool counters)
     {
         int64_t startCount = 0;
         int64_t endCount = 0;
@@ -308,6 +1586,12 @@ do                                                                             \
         PERFORMAN_SERIALIZE(stream, &startCount, sizeof(int64_t));
         PERFORMAN_SERIALIZE(stream, &endCount, sizeof(int64_t));
         Performan::Serialize(stream, _name);
+        if (counters) {
+            _counters.Serialize(stream);
+        }
+        PERFORMAN_SERIALIZE(stream, &_argsOffset, sizeof(uint32_t));
+        PERFORMAN_SERIALIZE(stream, &_argsCount, sizeof(uint32_t));
+        PERFORMAN_SERIALIZE(stream, &_weight, sizeof(uint32_t));
 
         if constexpr (Stream::IsReading)
         {
@@ -347,8 +1631,19 @@ do                                                                             \
         PERFORMAN_SERIALIZE(stream, tempValue, valueLength);
     }
 
-    template<class Stream, class T>
-    inline void SerializeVector(Stream& stream, std::vector<T>& values) {
+    template<class Stream>
+    inline void Serialize(Stream& stream, PortableNano& value)
+    {
+        int64_t count = value.count();
+        PERFORMAN_SERIALIZE(stream, &count, sizeof(int64_t));
+
+        if constexpr (Stream::IsReading) {
+            value = PortableNano(count);
+        }
+    }
+
+    template<class Stream, class T, class... Args>
+    inline void SerializeVector(Stream& stream, std::vector<T>& values, const Args&... args) {
         PERFORMAN_ASSERT(values.size() < UINT32_MAX);
         uint32_t size = 0;
 
@@ -366,7 +1661,7 @@ do                                                                             \
 
         for (uint32_t index = 0; index < size; index++)
         {
-            values[index].Serialize(stream);
+            values[index].Serialize(stream, args...);
         }
     }
 }
@@ -1,6 +1,7 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -26,7 +27,7 @@ struct SampleGame {
                 _updateStart = std::chrono::steady_clock::now();
 
                 {
-                    PM_SCOPED_EVENT("Sleep");
+                    PM_FRAME_WAIT(std::chrono::milliseconds(13));
                     std::unique_lock<std::mutex> lock(_waitMutex);
                     std::condition_variable cv;
 
@@ -63,15 +64,22 @@ struct SampleGame {
     std::atomic<bool> _running{ false };
 };
 
-int main() {
+int main(int argc, char** argv) {
     Performan::Profiler::CreateInstance();
     Performan::Profiler::GetInstance()->SetAllocator(&Performan::GetDefaultAllocator());
+    Performan::Profiler::GetInstance()->SetHardwareCountersEnabled(true);
+
+    // Run several samples along performan_collector to get a merged multi-process capture
+    if (argc > 1 && strcmp(argv[1], "--shared-memory") == 0) {
+        Performan::Profiler::GetInstance()->EnableSharedMemory();
+    }
     Performan::Profiler::GetInstance()->SetSaveCallback([](uint8_t* buffer, uint32_t size) {
         std::basic_ofstream<uint8_t> file("capture.pfm");
         file.write(buffer, size);
     });
 
     PM_THREAD("MainThread");
+    Performan::Profiler::GetInstance()->StartCapture();
 
     SampleGame game;
 
@@ -1,8 +1,51 @@
 #include "../include/performan.h"
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <map>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PERFORMAN_POSIX 1
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <process.h>
+#endif
+
+// AVX2 kernels are compiled with a target attribute and picked at runtime, MSVC needs /arch:AVX2
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PERFORMAN_AVX2 1
+#define PERFORMAN_AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(__AVX2__)
+#define PERFORMAN_AVX2 1
+#define PERFORMAN_AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define PERFORMAN_NEON 1
+#include <arm_neon.h>
+#endif
 
 namespace Performan {
 
@@ -40,155 +83,2261 @@ namespace Performan {
         return allocator;
     }
 
-    ////////////////////////////////// Profiler //////////////////////////////////
+    ////////////////////////////////// Hardware Counters //////////////////////////////////
 
-    void Profiler::CreateInstance()
+    CounterValues CounterValues::operator-(const CounterValues& rhs) const
     {
-        PERFORMAN_ASSERT(_instance == nullptr);
-        _instance = PERFORMAN_NEW(GetDefaultAllocator(), Profiler); // Pass user provided allocator
+        CounterValues result;
+        result._cycles = _cycles - rhs._cycles;
+        result._instructions = _instructions - rhs._instructions;
+        result._llcMisses = _llcMisses - rhs._llcMisses;
+        result._branchMisses = _branchMisses - rhs._branchMisses;
+        return result;
     }
 
-    void Profiler::DestroyInstance()
+    CounterValues CounterValues::operator*(uint64_t factor) const
     {
-        PERFORMAN_ASSERT(_instance != nullptr);
-        PERFORMAN_DELETE(GetDefaultAllocator(), Profiler, _instance); // Pass user provided allocator
+        CounterValues result;
+        result._cycles = _cycles * factor;
+        result._instructions = _instructions * factor;
+        result._llcMisses = _llcMisses * factor;
+        result._branchMisses = _branchMisses * factor;
+        return result;
     }
 
-    Profiler* Profiler::GetInstance()
+    CounterValues& CounterValues::operator+=(const CounterValues& rhs)
     {
-        PERFORMAN_ASSERT(_instance != nullptr);
-        return _instance;
+        _cycles += rhs._cycles;
+        _instructions += rhs._instructions;
+        _llcMisses += rhs._llcMisses;
+        _branchMisses += rhs._branchMisses;
+        return *this;
     }
 
-    void Profiler::SetAllocator(Allocator* allocator)
+#if defined(__linux__)
+    static int OpenPerfEvent(uint32_t type, uint64_t config, int groupFd)
     {
-        _allocator = allocator;
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = groupFd == -1 ? 1 : 0; // Leader starts the whole group
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        // pid = 0, cpu = -1: calling thread, any cpu
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
     }
 
-    void Profiler::StopCapture()
+#if defined(__x86_64__) || defined(__i386__)
+    static inline uint64_t ReadPmc(uint32_t counter)
+    {
+        uint32_t low, high;
+        __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+        return (static_cast<uint64_t>(high) << 32) | low;
+    }
+
+    // Seqlock protocol described in linux/perf_event.h
+    static bool ReadPageCounter(void* page, uint64_t& value)
+    {
+        volatile perf_event_mmap_page* pc = static_cast<perf_event_mmap_page*>(page);
+        uint32_t seq;
+        do {
+            seq = pc->lock;
+            std::atomic_signal_fence(std::memory_order_acquire);
+
+            uint32_t index = pc->index;
+            if (!pc->cap_user_rdpmc || index == 0) {
+                return false;
+            }
+
+            int64_t count = static_cast<int64_t>(ReadPmc(index - 1));
+            uint16_t width = pc->pmc_width;
+            count <<= 64 - width;
+            count >>= 64 - width;
+            value = static_cast<uint64_t>(pc->offset + count);
+
+            std::atomic_signal_fence(std::memory_order_acquire);
+        } while (pc->lock != seq);
+
+        return true;
+    }
+#endif
+#endif
+
+    bool HardwareCounters::Open()
     {
-        WriteStream wStream(_allocator);
+#if defined(__linux__)
+        constexpr uint32_t types[Count] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+        constexpr uint64_t configs[Count] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
 
-        if (_saveFct == nullptr)
+        for (int index = 0; index < Count; index++)
         {
-            return;
+            _fds[index] = OpenPerfEvent(types[index], configs[index], index == Cycles ? -1 : _fds[Cycles]);
+            if (_fds[index] < 0)
+            {
+                Close();
+                return false;
+            }
         }
 
+#if defined(__x86_64__) || defined(__i386__)
+        _rdpmc = true;
+        long pageSize = sysconf(_SC_PAGESIZE);
+        for (int index = 0; index < Count; index++)
         {
-            std::scoped_lock lock(_threadsMtx);
-            for (SoftPtr<Thread> thread : _threads)
+            void* page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, _fds[index], 0);
+            if (page == MAP_FAILED)
             {
-                thread->Serialize(wStream);
+                _rdpmc = false;
+                break;
             }
+
+            _pages[index] = page;
+            _rdpmc = _rdpmc && static_cast<perf_event_mmap_page*>(page)->cap_user_rdpmc;
         }
+#endif
 
-        uint32_t size = static_cast<uint32_t>(wStream.Offset());
-        _saveFct(wStream.Data(), size);
+        ioctl(_fds[Cycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(_fds[Cycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        return false;
+#endif
     }
 
-    Allocator* Profiler::GetAllocator() const
+    void HardwareCounters::Close()
     {
-        if (_allocator) {
-            return _allocator;
+#if defined(__linux__)
+        long pageSize = sysconf(_SC_PAGESIZE);
+        for (int index = Count - 1; index >= 0; index--)
+        {
+            if (_pages[index]) {
+                munmap(_pages[index], pageSize);
+                _pages[index] = nullptr;
+            }
+
+            if (_fds[index] >= 0) {
+                close(_fds[index]);
+                _fds[index] = -1;
+            }
         }
+#endif
+        _rdpmc = false;
+    }
 
-        return &(GetDefaultAllocator());
+    CounterValues HardwareCounters::Read() const
+    {
+        CounterValues values;
+
+#if defined(__linux__)
+        if (!IsValid()) {
+            return values;
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        if (_rdpmc
+            && ReadPageCounter(_pages[Cycles], values._cycles)
+            && ReadPageCounter(_pages[Instructions], values._instructions)
+            && ReadPageCounter(_pages[LlcMisses], values._llcMisses)
+            && ReadPageCounter(_pages[BranchMisses], values._branchMisses))
+        {
+            return values;
+        }
+#endif
+
+        // Group read layout: { nr, values[nr] }
+        uint64_t buffer[1 + Count] = {};
+        if (read(_fds[Cycles], buffer, sizeof(buffer)) == static_cast<ssize_t>(sizeof(buffer)))
+        {
+            values._cycles = buffer[1 + Cycles];
+            values._instructions = buffer[1 + Instructions];
+            values._llcMisses = buffer[1 + LlcMisses];
+            values._branchMisses = buffer[1 + BranchMisses];
+        }
+#endif
+
+        return values;
     }
 
-    SoftPtr<Thread> Profiler::AddThread(const char* name)
+    ////////////////////////////////// Shared Memory //////////////////////////////////
+
+    int32_t GetProcessId()
     {
-        // Dynamically allocate thread
-        Thread* th = PERFORMAN_NEW(*_allocator, Thread, name);
+#if defined(PERFORMAN_POSIX)
+        return static_cast<int32_t>(getpid());
+#elif defined(_WIN32)
+        return static_cast<int32_t>(_getpid());
+#else
+        return 0;
+#endif
+    }
+
+    static constexpr size_t SharedHeaderSize = (sizeof(SharedSegmentHeader) + alignof(SharedRing) - 1) & ~(alignof(SharedRing) - 1);
+
+    static int64_t NowCount(std::chrono::steady_clock)
+    {
+        return std::chrono::duration_cast<PortableNano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t NowCount(std::chrono::system_clock)
+    {
+        return std::chrono::duration_cast<PortableNano>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    size_t SharedMemorySegment::RingStride() const
+    {
+        return sizeof(SharedRing) + static_cast<size_t>(Header()->_ringCapacity) * sizeof(SharedRecord);
+    }
+
+    SharedRing* SharedMemorySegment::Ring(uint32_t index) const
+    {
+        PERFORMAN_ASSERT(index < Header()->_ringCount);
+        return reinterpret_cast<SharedRing*>(static_cast<uint8_t*>(_base) + SharedHeaderSize + index * RingStride());
+    }
+
+    bool SharedMemorySegment::Create(const char* name, uint32_t ringCount, uint32_t ringCapacity)
+    {
+#if defined(PERFORMAN_POSIX)
+        PERFORMAN_ASSERT(!IsValid());
+        PERFORMAN_ASSERT(ringCapacity > 0);
+
+        size_t size = SharedHeaderSize + ringCount * (sizeof(SharedRing) + static_cast<size_t>(ringCapacity) * sizeof(SharedRecord));
+
+        // Leftover of a dead process which had the same pid
+        shm_unlink(name);
+
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            return false;
+        }
+
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            close(fd);
+            shm_unlink(name);
+            return false;
+        }
+
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (base == MAP_FAILED)
+        {
+            shm_unlink(name);
+            return false;
+        }
+
+        _base = base;
+        _size = size;
+        _name = name;
+
+        SharedSegmentHeader* header = new (_base) SharedSegmentHeader();
+        header->_processId = GetProcessId();
+        header->_ringCount = ringCount;
+        header->_ringCapacity = ringCapacity;
+        header->_steadyAtCreation = NowCount(std::chrono::steady_clock());
+        header->_systemAtCreation = NowCount(std::chrono::system_clock());
 
+        for (uint32_t index = 0; index < ringCount; index++)
         {
-            std::scoped_lock lock(_threadsMtx);
-            _threads.push_back(th);
+            SharedRing* ring = new (Ring(index)) SharedRing();
+            ring->_capacity = ringCapacity;
         }
 
-        return { th };
+        // Readers ignore the segment until the magic is published
+        std::atomic_thread_fence(std::memory_order_release);
+        header->_magic = SharedSegmentHeader::Magic;
+        return true;
+#else
+        return false;
+#endif
     }
 
-    void Profiler::RemoveThread(SoftPtr<Thread> thread)
+    SharedRing* SharedMemorySegment::AcquireRing(const char* threadName)
     {
-        std::scoped_lock lock(_threadsMtx);
-        auto itFound = std::find_if(_threads.begin(), _threads.end(), [thread](const auto* other) { return other == thread._ptr; });
+        if (!IsValid()) {
+            return nullptr;
+        }
+
+        SharedSegmentHeader* header = Header();
+        SharedRing* ring = nullptr;
+
+        if (header->_nextRing.load(std::memory_order_relaxed) < header->_ringCount)
+        {
+            uint32_t index = header->_nextRing.fetch_add(1, std::memory_order_relaxed);
+            if (index < header->_ringCount) {
+                ring = Ring(index); // Free, ignored by the collector until used
+            }
+        }
 
-        if (itFound != _threads.end())
+        // Every ring was handed out once, reuse one the collector read entirely since its thread was released
+        for (uint32_t index = 0; ring == nullptr && index < header->_ringCount; index++)
         {
-            _threads.erase(itFound);
+            SharedRing* candidate = Ring(index);
+            uint32_t state = SharedRing::Released;
+            if (candidate->_state.load(std::memory_order_relaxed) == SharedRing::Released
+                && candidate->_readPos.load(std::memory_order_acquire) == candidate->_writePos.load(std::memory_order_relaxed)
+                && candidate->_state.compare_exchange_strong(state, SharedRing::Claimed, std::memory_order_acq_rel)) {
+                ring = candidate;
+            }
+        }
+
+        if (ring == nullptr)
+        {
+            header->_fallbackThreads.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
         }
+
+        memset(ring->_threadName, 0, sizeof(ring->_threadName));
+        if (threadName) {
+            strncpy(ring->_threadName, threadName, sizeof(ring->_threadName) - 1);
+        }
+        ring->_generation.fetch_add(1, std::memory_order_relaxed);
+        ring->_state.store(SharedRing::Used, std::memory_order_release);
+        return ring;
     }
 
-    Profiler::~Profiler()
+    void SharedMemorySegment::ReleaseRing(SharedRing* ring)
+    {
+        // After the last push of its thread, the collector drains it before it gets reused
+        ring->_state.store(SharedRing::Released, std::memory_order_release);
+    }
+
+    bool SharedMemorySegment::Open(const char* name)
     {
-        for (auto* thread : _threads) {
-            delete thread;
+#if defined(PERFORMAN_POSIX)
+        PERFORMAN_ASSERT(!IsValid());
+
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < SharedHeaderSize)
+        {
+            close(fd);
+            return false;
+        }
+
+        size_t size = static_cast<size_t>(info.st_size);
+        void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (base == MAP_FAILED) {
+            return false;
+        }
+
+        const SharedSegmentHeader* header = static_cast<SharedSegmentHeader*>(base);
+        bool valid = header->_magic == SharedSegmentHeader::Magic && header->_version == SharedSegmentHeader::Version;
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        size_t expectedSize = SharedHeaderSize + header->_ringCount * (sizeof(SharedRing) + static_cast<size_t>(header->_ringCapacity) * sizeof(SharedRecord));
+        if (!valid || header->_ringCapacity == 0 || size < expectedSize)
+        {
+            munmap(base, size);
+            return false;
         }
+
+        _base = base;
+        _size = size;
+        _name = name;
+        return true;
+#else
+        return false;
+#endif
     }
 
-    ////////////////////////////////// Serialization //////////////////////////////////
+    void SharedMemorySegment::Close(bool unlink)
+    {
+#if defined(PERFORMAN_POSIX)
+        if (_base) {
+            munmap(_base, _size);
+        }
 
-    Stream::Stream(Allocator* allocator)
-        : _allocator(allocator)
+        if (unlink && !_name.empty()) {
+            shm_unlink(_name.c_str());
+        }
+#endif
+        _base = nullptr;
+        _size = 0;
+        _name.clear();
+    }
+
+    ////////////////////////////////// Statistics //////////////////////////////////
+
+    uint32_t DurationHistogram::BucketIndex(uint64_t value)
     {
+        if (value < SubBucketCount) {
+            return static_cast<uint32_t>(value);
+        }
+
+        // Highest bit selects the power of two, the next SubBucketBits bits the sub bucket
+        uint32_t exponent = 63 - static_cast<uint32_t>(std::countl_zero(value));
+        uint32_t subBucket = static_cast<uint32_t>(value >> (exponent - SubBucketBits)) & (SubBucketCount - 1);
+        return (exponent - SubBucketBits + 1) * SubBucketCount + subBucket;
     }
 
-    Stream::Stream(Allocator* allocator, uint8_t* buffer, size_t size)
-        : _allocator(allocator)
-        , _size(size)
+    uint64_t DurationHistogram::BucketValue(uint32_t index)
     {
-        _buffer = (uint8_t*)PERFORMAN_ALLOCATE(*_allocator, size);
-        memcpy(_buffer, buffer, size);
+        if (index < SubBucketCount) {
+            return index;
+        }
+
+        uint32_t exponent = index / SubBucketCount + SubBucketBits - 1;
+        uint64_t subBucket = index % SubBucketCount;
+        uint64_t width = 1ull << (exponent - SubBucketBits);
+        return ((SubBucketCount + subBucket) << (exponent - SubBucketBits)) + width / 2;
     }
 
-    Stream::~Stream()
+    void DurationHistogram::Reset()
     {
-        Clear();
+        for (std::atomic<uint64_t>& bucket : _buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+
+        _count.store(0, std::memory_order_relaxed);
+        _total.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
     }
 
-    void Stream::Resize()
+    void HistogramSnapshot::Merge(const DurationHistogram& histogram)
     {
-        // 1. Reallocate new internal buffer
-        constexpr size_t firstAllocDefaultSize = 1024; // 1024 bytes (1KB)
+        for (uint32_t index = 0; index < DurationHistogram::BucketCount; index++) {
+            _buckets[index] += histogram._buckets[index].load(std::memory_order_relaxed);
+        }
 
-        size_t allocSize = _size > 0 ? _size * 2 : firstAllocDefaultSize;
-        uint8_t* buf = (uint8_t*)PERFORMAN_ALLOCATE(*_allocator, allocSize);
+        _count += histogram._count.load(std::memory_order_relaxed);
+        _total += histogram._total.load(std::memory_order_relaxed);
+        _max = std::max(_max, histogram._max.load(std::memory_order_relaxed));
+    }
 
-        // 2. Copy previous buffer data
-        if (_buffer) {
-            memcpy(buf, _buffer, _size);
+    void HistogramSnapshot::Merge(const HistogramSnapshot& snapshot)
+    {
+        for (uint32_t index = 0; index < DurationHistogram::BucketCount; index++) {
+            _buckets[index] += snapshot._buckets[index];
         }
 
-        _size = allocSize;
+        _count += snapshot._count;
+        _total += snapshot._total;
+        _max = std::max(_max, snapshot._max);
+    }
 
-        // 3. Swap internal buffer & delete previous
-        uint8_t* prevBuf = _buffer;
-        _buffer = buf;
+    DurationStats HistogramSnapshot::Stats() const
+    {
+        DurationStats stats;
 
-        delete[] prevBuf;
+        // Buckets are read one by one while threads record, use their sum as the count
+        uint64_t count = 0;
+        for (uint64_t bucket : _buckets) {
+            count += bucket;
+        }
+
+        if (count == 0) {
+            return stats;
+        }
+
+        auto percentile = [this, count](double percentile) {
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile * static_cast<double>(count))));
+            uint64_t cumulated = 0;
+
+            for (uint32_t index = 0; index < DurationHistogram::BucketCount; index++)
+            {
+                cumulated += _buckets[index];
+                if (cumulated >= rank) {
+                    return PortableNano(static_cast<int64_t>(std::min(DurationHistogram::BucketValue(index), _max)));
+                }
+            }
+            return PortableNano(static_cast<int64_t>(_max));
+        };
+
+        stats._count = count;
+        stats._mean = PortableNano(static_cast<int64_t>(_total / std::max<uint64_t>(_count, 1)));
+        stats._p50 = percentile(0.50);
+        stats._p90 = percentile(0.90);
+        stats._p99 = percentile(0.99);
+        stats._max = PortableNano(static_cast<int64_t>(_max));
+        return stats;
     }
 
-    void Stream::Clear()
+    ThreadStats::~ThreadStats()
     {
-        _size = 0;
-        _offset = 0;
+        for (std::atomic<DurationHistogram*>& histogram : _histograms)
+        {
+            DurationHistogram* ptr = histogram.load(std::memory_order_relaxed);
+            PERFORMAN_DELETE(*_allocator, DurationHistogram, ptr);
+        }
 
-        delete[] _buffer;
-        _buffer = nullptr;
+        DurationHistogram* frames = _frames.load(std::memory_order_relaxed);
+        PERFORMAN_DELETE(*_allocator, DurationHistogram, frames);
     }
 
-    void WriteStream::SerializeBytes(void* value, size_t size)
+    DurationHistogram* ThreadStats::Insert(uint32_t index, const char* name)
     {
-        if (_size - _offset < size) {
-            Resize();
+        DurationHistogram* histogram = PERFORMAN_NEW(*_allocator, DurationHistogram);
+        _histograms[index].store(histogram, std::memory_order_relaxed);
+        _names[index].store(name, std::memory_order_release);
+        return histogram;
+    }
+
+    DurationHistogram* ThreadStats::AcquireFrames()
+    {
+        DurationHistogram* frames = _frames.load(std::memory_order_relaxed);
+        if (frames == nullptr)
+        {
+            frames = PERFORMAN_NEW(*_allocator, DurationHistogram);
+            _frames.store(frames, std::memory_order_release);
         }
-        memcpy(&_buffer[_offset], value, size);
-        _offset += size;
+        return frames;
     }
 
-    void ReadStream::SerializeBytes(void* value, size_t size)
+    void ThreadStats::Reset(uint32_t epoch)
     {
-        memcpy(value, &_buffer[_offset], size);
-        _offset += size;
+        for (std::atomic<DurationHistogram*>& histogram : _histograms)
+        {
+            if (DurationHistogram* ptr = histogram.load(std::memory_order_relaxed)) {
+                ptr->Reset();
+            }
+        }
+
+        if (DurationHistogram* frames = _frames.load(std::memory_order_relaxed)) {
+            frames->Reset();
+        }
+
+        _epoch.store(epoch, std::memory_order_release);
+    }
+
+    void ThreadStats::Collect(const char* name, HistogramSnapshot& snapshot) const
+    {
+        for (uint32_t index = 0; index < Capacity; index++)
+        {
+            const char* key = _names[index].load(std::memory_order_acquire);
+            if (key != nullptr && (key == name || strcmp(key, name) == 0)) {
+                snapshot.Merge(*_histograms[index].load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    ////////////////////////////////// Profiler //////////////////////////////////
+
+    void Profiler::CreateInstance()
+    {
+        PERFORMAN_ASSERT(_instance == nullptr);
+        _instance = PERFORMAN_NEW(GetDefaultAllocator(), Profiler); // Pass user provided allocator
+        _generation.fetch_add(1, std::memory_order_release);
+    }
+
+    void Profiler::DestroyInstance()
+    {
+        PERFORMAN_ASSERT(_instance != nullptr);
+        _activeState.store(0, std::memory_order_relaxed);
+        _generation.fetch_add(1, std::memory_order_release);
+        PERFORMAN_DELETE(GetDefaultAllocator(), Profiler, _instance); // Pass user provided allocator
+    }
+
+    Profiler* Profiler::GetInstance()
+    {
+        PERFORMAN_ASSERT(_instance != nullptr);
+        return _instance;
+    }
+
+    void Profiler::SetAllocator(Allocator* allocator)
+    {
+        _allocator = allocator;
+    }
+
+    void Profiler::StartCapture(CategoryMask categories)
+    {
+        // New epoch first, so scopes seeing the mask drop buffers of the previous capture
+        _captureEpoch.fetch_add(1, std::memory_order_relaxed);
+        UpdateActiveState(StatsBits, categories);
+
+        // Once capturing, so the macros take the recording path
+        CalibrateOverhead(categories);
+    }
+
+    void Profiler::StopCapture()
+    {
+        // Before the macros stop recording, the header gets the measured overhead
+        WaitForCalibration();
+        UpdateActiveState(StatsBits, 0);
+
+        WriteStream wStream(GetAllocator());
+        _captureHeader.Serialize(wStream);
+
+        {
+            std::scoped_lock lock(_flushMtx);
+            uint32_t epoch = _captureEpoch.load(std::memory_order_relaxed);
+
+            // Scopes open across the stop may still append. Each thread buffer is closed under its lock,
+            // appends that follow are dropped, so buffers are written once nothing writes them anymore.
+            // Shared memory processes usually have no callback, retired threads are released anyway.
+            for (ThreadEntry* entry = _threads.load(std::memory_order_acquire); entry != nullptr; entry = entry->_next)
+            {
+                Thread& thread = entry->_thread;
+                thread._bufferLock.Lock();
+
+                if (thread._captureEpoch == epoch)
+                {
+                    FlushSkippedCalls(thread);
+                    thread._closedEpoch = epoch;
+                    if (_saveFct) {
+                        thread.Serialize(wStream);
+                    }
+                }
+
+                thread._bufferLock.Unlock();
+            }
+
+            ReleaseRetiredThreads();
+        }
+
+        if (_saveFct)
+        {
+            uint32_t size = static_cast<uint32_t>(wStream.Offset());
+            _saveFct(wStream.Data(), size);
+        }
+    }
+
+    void Profiler::CalibrateOverhead(CategoryMask categories)
+    {
+        // Capture restarted without a stop
+        WaitForCalibration();
+
+        // Only rings and hardware counters change the cost of a scope, each capture would measure the same
+        bool sharedMemory = _sharedMemory.IsValid();
+        if (_calibrated && _calibratedSharedMemory == sharedMemory && _calibratedCounters == _hardwareCountersEnabled) {
+            return;
+        }
+
+        _calibrated = true;
+        _calibratedSharedMemory = sharedMemory;
+        _calibratedCounters = _hardwareCountersEnabled;
+
+        // Runs the macros on a thread registered like any other but kept out of the thread list: buffers grow,
+        // epochs sync and locks are taken as during the capture, then the thread is deleted with everything it recorded.
+        // The fastest round wins, preemption only adds time.
+        _calibration = std::thread([this, categories]() {
+            constexpr int iterations = 2000;
+            constexpr int rounds = 5;
+
+            PortableNano eventOverhead = PortableNano::max();
+            PortableNano frameOverhead = PortableNano::max();
+
+            ThreadEntry* entry = CreateThreadEntry("Calibration");
+            _threadLocal._entry = entry;
+            _threadLocal._generation = _generation.load(std::memory_order_acquire);
+
+            // Kept out of the segment, the collector would read calibration records as a thread of the process
+            SharedRing* ring = nullptr;
+            if (_sharedMemory.IsValid())
+            {
+                size_t capacity = 2 * iterations;
+                void* memory = ::operator new(sizeof(SharedRing) + capacity * sizeof(SharedRecord), std::align_val_t(alignof(SharedRing)));
+                ring = new (memory) SharedRing();
+                ring->_capacity = static_cast<uint32_t>(capacity);
+                entry->_thread._ring = ring;
+            }
+
+            for (int round = 0; round < rounds; round++)
+            {
+                if (ring) {
+                    ring->_readPos.store(ring->_writePos.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                for (int index = 0; index < iterations; index++) {
+                    PM_SCOPED_EVENT_CATEGORY("Calibration", categories);
+                }
+                auto middle = std::chrono::steady_clock::now();
+                for (int index = 0; index < iterations; index++) {
+                    PM_SCOPED_FRAME();
+                }
+                auto end = std::chrono::steady_clock::now();
+
+                eventOverhead = std::min<PortableNano>(eventOverhead, (middle - start) / iterations);
+                frameOverhead = std::min<PortableNano>(frameOverhead, (end - middle) / iterations);
+            }
+
+            _threadLocal._entry = nullptr;
+            _threadLocal._generation = 0;
+            DeleteThreadEntry(entry);
+
+            if (ring)
+            {
+                ring->~SharedRing();
+                ::operator delete(ring, std::align_val_t(alignof(SharedRing)));
+            }
+
+            // Read by StopCapture once joined
+            _captureHeader._eventOverhead = eventOverhead;
+            _captureHeader._frameOverhead = frameOverhead;
+
+            if (_sharedMemory.IsValid()) {
+                _sharedMemory.Header()->_eventOverhead.store(eventOverhead.count(), std::memory_order_relaxed);
+                _sharedMemory.Header()->_frameOverhead.store(frameOverhead.count(), std::memory_order_relaxed);
+            }
+        });
+    }
+
+    void Profiler::WaitForCalibration()
+    {
+        if (_calibration.joinable()) {
+            _calibration.join();
+        }
+    }
+
+    void Profiler::FlushSkippedCalls(Thread& thread)
+    {
+        // Owners only add skipped calls to their last event under the lock, and zero them with it
+        for (SamplingState* state = thread._samplers; state != nullptr; state = state->_next)
+        {
+            uint32_t skipped = state->_skipped.load(std::memory_order_relaxed);
+            if (skipped > 0 && state->_lastEvent < thread._events.size()) {
+                thread._events[state->_lastEvent]._weight += skipped;
+            }
+        }
+        thread._samplers = nullptr;
+    }
+
+    void Profiler::UpdateActiveState(uint64_t keepBits, uint64_t setBits)
+    {
+        uint64_t state = _activeState.load(std::memory_order_relaxed);
+        while (!_activeState.compare_exchange_weak(state, (state & keepBits) | setBits, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    void Profiler::EnableStats(CategoryMask categories)
+    {
+        UpdateActiveState(CaptureBits, static_cast<uint64_t>(categories) << 32);
+    }
+
+    void Profiler::DisableStats()
+    {
+        UpdateActiveState(CaptureBits, 0);
+    }
+
+    DurationStats Profiler::QueryStats(const char* name)
+    {
+        PERFORMAN_ASSERT(name != nullptr);
+        HistogramSnapshot snapshot;
+        std::scoped_lock lock(_flushMtx);
+
+        // Out of a capture, retired threads have nothing left to flush
+        if (!IsCapturing()) {
+            ReleaseRetiredThreads();
+        }
+
+        auto itFound = _retiredStats.find(name);
+        if (itFound != _retiredStats.end()) {
+            snapshot.Merge(itFound->second);
+        }
+
+        for (ThreadEntry* entry = _threads.load(std::memory_order_acquire); entry != nullptr; entry = entry->_next)
+        {
+            if (IsStatsCurrent(entry->_thread._stats)) {
+                entry->_thread._stats->Collect(name, snapshot);
+            }
+        }
+
+        return snapshot.Stats();
+    }
+
+    DurationStats Profiler::QueryFrameStats()
+    {
+        HistogramSnapshot snapshot;
+        std::scoped_lock lock(_flushMtx);
+
+        if (!IsCapturing()) {
+            ReleaseRetiredThreads();
+        }
+
+        snapshot.Merge(_retiredFrameStats);
+
+        for (ThreadEntry* entry = _threads.load(std::memory_order_acquire); entry != nullptr; entry = entry->_next)
+        {
+            if (!IsStatsCurrent(entry->_thread._stats)) {
+                continue;
+            }
+
+            if (const DurationHistogram* frames = entry->_thread._stats->_frames.load(std::memory_order_acquire)) {
+                snapshot.Merge(*frames);
+            }
+        }
+
+        return snapshot.Stats();
+    }
+
+    void Profiler::ResetStats()
+    {
+        std::scoped_lock lock(_flushMtx);
+        _statsEpoch.fetch_add(1, std::memory_order_relaxed);
+        _retiredStats.clear();
+        _retiredFrameStats = HistogramSnapshot();
+    }
+
+    bool Profiler::IsStatsCurrent(const ThreadStats* stats)
+    {
+        return stats != nullptr && stats->_epoch.load(std::memory_order_acquire) == _statsEpoch.load(std::memory_order_relaxed);
+    }
+
+    Allocator* Profiler::GetAllocator() const
+    {
+        if (_allocator) {
+            return _allocator;
+        }
+
+        return &(GetDefaultAllocator());
+    }
+
+    SoftPtr<Thread> Profiler::AddThread(const char* name)
+    {
+        return { RegisterCurrentThread(name) };
+    }
+
+    Profiler::ThreadEntry* Profiler::CreateThreadEntry(const char* name)
+    {
+        Profiler* profiler = GetInstance();
+
+        // Dynamically allocate thread
+        ThreadEntry* entry = PERFORMAN_NEW(*profiler->GetAllocator(), ThreadEntry, name ? name : "Thread");
+
+        entry->_thread._processId = GetProcessId();
+        entry->_thread._stats = PERFORMAN_NEW(*profiler->GetAllocator(), ThreadStats, profiler->GetAllocator());
+        entry->_thread._stats->_epoch.store(_statsEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        if (profiler->_hardwareCountersEnabled) {
+            entry->_thread._counters.Open(); // Events fall back to zeroed counters on failure
+        }
+
+        return entry;
+    }
+
+    void Profiler::DeleteThreadEntry(ThreadEntry* entry)
+    {
+        entry->_thread._counters.Close();
+        PERFORMAN_DELETE(*GetAllocator(), ThreadStats, entry->_thread._stats);
+        PERFORMAN_DELETE(*GetAllocator(), ThreadEntry, entry);
+    }
+
+    Thread* Profiler::RegisterCurrentThread(const char* name)
+    {
+        Profiler* profiler = GetInstance();
+        ThreadLocalState& state = _threadLocal;
+
+        // Previous registration of this thread, only kept until the next flush.
+        // Unnamed registrations keep the name of a registration removed from another thread.
+        uint32_t generation = _generation.load(std::memory_order_acquire);
+        if (state._entry && state._generation == generation)
+        {
+            if (name == nullptr) {
+                name = state._entry->_thread._name;
+            }
+
+            RetireOwnEntry(state._entry);
+        }
+
+        ThreadEntry* entry = CreateThreadEntry(name);
+        entry->_thread._ring = profiler->_sharedMemory.AcquireRing(entry->_thread._name);
+
+        ThreadEntry* head = profiler->_threads.load(std::memory_order_relaxed);
+        do {
+            entry->_next = head;
+        } while (!profiler->_threads.compare_exchange_weak(head, entry, std::memory_order_release, std::memory_order_relaxed));
+
+        state._entry = entry;
+        state._generation = generation;
+        return &entry->_thread;
+    }
+
+    void Profiler::RemoveThread(SoftPtr<Thread> thread)
+    {
+        // Threads are the first member of their entry
+        PERFORMAN_STATIC_ASSERT(std::is_standard_layout_v<ThreadEntry>);
+        ThreadEntry* entry = reinterpret_cast<ThreadEntry*>(thread._ptr);
+
+        // From another thread, the entry stays owned until its thread registers again or exits
+        if (_threadLocal._entry != entry)
+        {
+            entry->_retired.store(true, std::memory_order_release);
+            return;
+        }
+
+        RetireOwnEntry(entry);
+        _threadLocal._entry = nullptr;
+        _threadLocal._generation = 0;
+    }
+
+    void Profiler::ReleaseRetiredThreads()
+    {
+        // Only called under _flushMtx: new entries can be pushed at head concurrently, nothing else unlinks
+        ThreadEntry* prev = nullptr;
+        ThreadEntry* entry = _threads.load(std::memory_order_acquire);
+
+        while (entry != nullptr)
+        {
+            ThreadEntry* next = entry->_next;
+
+            // Scopes open on a thread that gave its entry up still write it until they end
+            if (!entry->_retired.load(std::memory_order_acquire) || entry->_owned.load(std::memory_order_acquire)
+                || std::atomic_ref<uint32_t>(entry->_thread._openScopes).load(std::memory_order_acquire) != 0)
+            {
+                prev = entry;
+                entry = next;
+                continue;
+            }
+
+            if (prev != nullptr)
+            {
+                prev->_next = next;
+            }
+            else
+            {
+                ThreadEntry* expected = entry;
+                if (!_threads.compare_exchange_strong(expected, next, std::memory_order_acq_rel))
+                {
+                    // Threads were pushed in front of us, find our predecessor again
+                    prev = expected;
+                    while (prev->_next != entry) {
+                        prev = prev->_next;
+                    }
+                    prev->_next = next;
+                }
+            }
+
+            // Keep the statistics of the thread around
+            ThreadStats* stats = entry->_thread._stats;
+            if (IsStatsCurrent(stats))
+            {
+                for (uint32_t index = 0; index < ThreadStats::Capacity; index++)
+                {
+                    const char* name = stats->_names[index].load(std::memory_order_acquire);
+                    if (name != nullptr) {
+                        _retiredStats[name].Merge(*stats->_histograms[index].load(std::memory_order_relaxed));
+                    }
+                }
+
+                if (const DurationHistogram* frames = stats->_frames.load(std::memory_order_acquire)) {
+                    _retiredFrameStats.Merge(*frames);
+                }
+            }
+
+            DeleteThreadEntry(entry);
+            entry = next;
+        }
+    }
+
+    void Profiler::RetireOwnEntry(ThreadEntry* entry)
+    {
+        // Counters only count this thread and its last push is done, don't hold either until the next flush.
+        // Scopes still open record in process from here on.
+        Thread& thread = entry->_thread;
+        thread._counters.Close();
+
+        // Sampling states are thread locals as well
+        thread._bufferLock.Lock();
+        FlushSkippedCalls(thread);
+        thread._bufferLock.Unlock();
+
+        if (SharedRing* ring = thread._ring)
+        {
+            thread._ring = nullptr;
+            GetInstance()->_sharedMemory.ReleaseRing(ring);
+        }
+
+        entry->_retired.store(true, std::memory_order_release);
+        entry->_owned.store(false, std::memory_order_release);
+    }
+
+    const char* Profiler::InternString(const char* value)
+    {
+        if (value == nullptr) {
+            return nullptr;
+        }
+
+        std::scoped_lock lock(_internMtx);
+        return _internedStrings.emplace(value).first->c_str();
+    }
+
+    bool Profiler::EnableSharedMemory(const char* prefix, uint32_t maxThreads, uint32_t ringCapacity)
+    {
+        if (_sharedMemory.IsValid()) {
+            return true;
+        }
+
+        std::string name = std::string("/") + prefix + "." + std::to_string(GetProcessId());
+        return _sharedMemory.Create(name.c_str(), maxThreads, ringCapacity);
+    }
+
+    Profiler::ThreadLocalState::~ThreadLocalState()
+    {
+        // Last access, the entry can be released right after
+        if (_entry && _generation == Profiler::_generation.load(std::memory_order_acquire)) {
+            RetireOwnEntry(_entry);
+        }
+    }
+
+    Profiler::~Profiler()
+    {
+        WaitForCalibration();
+
+        ThreadEntry* entry = _threads.exchange(nullptr);
+        while (entry != nullptr)
+        {
+            ThreadEntry* next = entry->_next;
+            DeleteThreadEntry(entry);
+            entry = next;
+        }
+    }
+
+    ////////////////////////////////// Scopes //////////////////////////////////
+
+    void EventScope::Begin(SoftPtr<Thread> thread, const char* name, uint64_t active, uint32_t weight, SamplingState* sampling)
+    {
+        _thread = thread;
+        _thread->OpenScope();
+        new (&_active) Active();
+        _active._event._name = name;
+        _active._event._weight = weight;
+        _active._sampling = sampling;
+        _active._recording = (active & Profiler::CaptureBits) != 0;
+        _active._stats = (active & Profiler::StatsBits) != 0;
+
+        if (_active._recording)
+        {
+            Profiler::SyncCaptureEpoch(*_thread);
+            _active._captureEpoch = _thread->_captureEpoch;
+
+            // Shared memory records carry no counters, End does not read them either
+            if (_thread->_ring == nullptr && _thread->_counters.IsValid()) {
+                _active._countersStart = _thread->_counters.Read();
+            }
+        }
+
+        _active._event._start = std::chrono::steady_clock::now();
+    }
+
+    void FrameScope::Begin(SoftPtr<Thread> thread, uint64_t active)
+    {
+        _thread = thread;
+        _thread->OpenScope();
+        new (&_active) Active();
+        _active._recording = (active & Profiler::CaptureBits) != 0;
+        _active._stats = (active & Profiler::StatsBits) != 0;
+
+        Frame& frame = _active._frame;
+        if (_active._recording)
+        {
+            Profiler::SyncCaptureEpoch(*_thread);
+            _active._captureEpoch = _thread->_captureEpoch;
+            frame._frameIdx = _thread->_frameCount++;
+            _active._previous = _thread->_currentFrame;
+            _thread->_currentFrame = &frame;
+        }
+
+        frame._start = std::chrono::steady_clock::now();
+        if (_active._recording && _thread->_lastFrameEnd != PortableTimePoint()) {
+            frame._gap = frame._start - _thread->_lastFrameEnd;
+        }
+    }
+
+    ////////////////////////////////// Collector //////////////////////////////////
+
+    bool SharedMemoryReader::Open(const char* name)
+    {
+        if (!_segment.Open(name)) {
+            return false;
+        }
+
+        // Steady clocks are shared on a machine unless processes live in different time namespaces.
+        // Map their steady clock on ours through the system clock, but ignore offsets in the noise of
+        // that mapping, the system clock is slewed while steady clocks are not.
+        constexpr int64_t noiseThreshold = 10'000'000; // 10 ms
+
+        const SharedSegmentHeader* header = _segment.Header();
+        int64_t offset = (NowCount(std::chrono::steady_clock()) - NowCount(std::chrono::system_clock()))
+            - (header->_steadyAtCreation - header->_systemAtCreation);
+        _clockOffset = PortableNano(std::abs(offset) > noiseThreshold ? offset : 0);
+
+        return true;
+    }
+
+    void SharedMemoryReader::Close(bool unlink)
+    {
+        _segment.Close(unlink);
+    }
+
+    int32_t SharedMemoryReader::ProcessId() const
+    {
+        return _segment.IsValid() ? _segment.Header()->_processId : 0;
+    }
+
+    bool SharedMemoryReader::IsProcessAlive() const
+    {
+#if defined(PERFORMAN_POSIX)
+        int32_t processId = ProcessId();
+        return processId > 0 && (kill(processId, 0) == 0 || errno == EPERM);
+#else
+        return false;
+#endif
+    }
+
+    const char* SharedMemoryReader::Intern(const char* value, size_t maxLength)
+    {
+        return _strings.emplace(value, strnlen(value, maxLength)).first->c_str();
+    }
+
+    size_t SharedMemoryReader::Drain()
+    {
+        if (!_segment.IsValid()) {
+            return 0;
+        }
+
+        const SharedSegmentHeader* header = _segment.Header();
+        uint32_t ringCount = std::min(header->_nextRing.load(std::memory_order_acquire), header->_ringCount);
+        if (_ringThreads.size() < ringCount)
+        {
+            _ringThreads.resize(ringCount, 0);
+            _ringGenerations.resize(ringCount, 0);
+        }
+
+        size_t drained = 0;
+        for (uint32_t index = 0; index < ringCount; index++)
+        {
+            SharedRing* ring = _segment.Ring(index);
+            uint32_t state = ring->_state.load(std::memory_order_acquire);
+            if (state == SharedRing::Free || state == SharedRing::Claimed) {
+                continue;
+            }
+
+            // Pending records block the reuse of the ring, they belong to the generation read after them
+            uint64_t read = ring->_readPos.load(std::memory_order_relaxed);
+            uint64_t write = ring->_writePos.load(std::memory_order_acquire);
+            uint32_t generation = ring->_generation.load(std::memory_order_acquire);
+
+            if (generation != _ringGenerations[index])
+            {
+                // New owner, its name is only valid if the ring was not handed over again while copying it
+                char name[sizeof(ring->_threadName)];
+                memcpy(name, ring->_threadName, sizeof(name));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (ring->_state.load(std::memory_order_relaxed) == SharedRing::Claimed || ring->_generation.load(std::memory_order_relaxed) != generation) {
+                    continue;
+                }
+
+                Thread& thread = _threads.emplace_back();
+                thread._name = Intern(name, sizeof(name));
+                thread._processId = header->_processId;
+                _ringThreads[index] = _threads.size() - 1;
+                _ringGenerations[index] = generation;
+            }
+
+            Thread& thread = _threads[_ringThreads[index]];
+            SharedRecord* records = ring->Records();
+
+            for (uint64_t position = read; position < write; position++)
+            {
+                const SharedRecord& record = records[position % ring->_capacity];
+                PortableTimePoint start(PortableNano(record._start) + _clockOffset);
+                PortableTimePoint end(PortableNano(record._end) + _clockOffset);
+
+                if (record._kind == SharedRecord::FrameRecord)
+                {
+                    Frame& frame = thread._frames.emplace_back();
+                    frame._start = start;
+                    frame._end = end;
+                    frame._frameIdx = record._index;
+                    record.GetFrameTimes(frame._gap, frame._waitIntended, frame._waitActual);
+                }
+                else
+                {
+                    Event& evt = thread._events.emplace_back(Intern(record._name, sizeof(record._name)));
+                    evt._start = start;
+                    evt._end = end;
+                    evt._weight = std::max<uint32_t>(record._index, 1);
+                }
+            }
+
+            ring->_readPos.store(write, std::memory_order_release);
+            drained += write - read;
+        }
+
+        return drained;
+    }
+
+    PortableNano SharedMemoryReader::EventOverhead() const
+    {
+        return PortableNano(_segment.IsValid() ? _segment.Header()->_eventOverhead.load(std::memory_order_relaxed) : 0);
+    }
+
+    PortableNano SharedMemoryReader::FrameOverhead() const
+    {
+        return PortableNano(_segment.IsValid() ? _segment.Header()->_frameOverhead.load(std::memory_order_relaxed) : 0);
+    }
+
+    uint32_t SharedMemoryReader::FallbackThreads() const
+    {
+        return _segment.IsValid() ? _segment.Header()->_fallbackThreads.load(std::memory_order_relaxed) : 0;
+    }
+
+    uint64_t SharedMemoryReader::Dropped() const
+    {
+        if (!_segment.IsValid()) {
+            return 0;
+        }
+
+        uint64_t dropped = 0;
+        for (uint32_t index = 0; index < _segment.Header()->_ringCount; index++) {
+            dropped += _segment.Ring(index)->_dropped.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+    uint64_t SharedMemoryReader::DroppedArgs() const
+    {
+        if (!_segment.IsValid()) {
+            return 0;
+        }
+
+        uint64_t dropped = 0;
+        for (uint32_t index = 0; index < _segment.Header()->_ringCount; index++) {
+            dropped += _segment.Ring(index)->_droppedArgs.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+    ////////////////////////////////// Analysis //////////////////////////////////
+
+    double EventStats::InstructionsPerCycle() const
+    {
+        return _counters._cycles > 0 ? static_cast<double>(_counters._instructions) / static_cast<double>(_counters._cycles) : 0.0;
+    }
+
+    double EventStats::LlcMissesPerCall() const
+    {
+        return _calls > 0 ? static_cast<double>(_counters._llcMisses) / static_cast<double>(_calls) : 0.0;
+    }
+
+    double EventStats::BranchMissesPerCall() const
+    {
+        return _calls > 0 ? static_cast<double>(_counters._branchMisses) / static_cast<double>(_calls) : 0.0;
+    }
+
+    std::vector<EventStats> AnalyzeEvents(const std::vector<Thread>& threads)
+    {
+        // Deserialized names are distinct allocations, group by content
+        std::unordered_map<std::string_view, EventStats> statsByName;
+
+        for (const Thread& thread : threads)
+        {
+            for (const Event& evt : thread._events)
+            {
+                std::string_view key = evt._name ? evt._name : "";
+                EventStats& stats = statsByName[key];
+                stats._name = evt._name;
+                stats._calls += evt._weight;
+                stats._samples++;
+                stats._total += (evt._end - evt._start) * evt._weight;
+                stats._counters += evt._counters * evt._weight;
+            }
+        }
+
+        std::vector<EventStats> result;
+        result.reserve(statsByName.size());
+        for (const auto& [name, stats] : statsByName) {
+            result.push_back(stats);
+        }
+
+        std::sort(result.begin(), result.end(), [](const EventStats& lhs, const EventStats& rhs) { return lhs._total > rhs._total; });
+        return result;
+    }
+
+    // Nearest rank percentile, sorts durations
+    static PortableNano Percentile(std::vector<PortableNano>& durations, double percentile)
+    {
+        if (durations.empty()) {
+            return PortableNano(0);
+        }
+
+        std::sort(durations.begin(), durations.end());
+        size_t rank = static_cast<size_t>(std::ceil(percentile * static_cast<double>(durations.size())));
+        return durations[std::clamp<size_t>(rank, 1, durations.size()) - 1];
+    }
+
+    const EventArg* FindEventArg(const Thread& thread, const Event& evt, const char* key)
+    {
+        for (uint32_t index = 0; index < evt._argsCount; index++)
+        {
+            size_t argIndex = static_cast<size_t>(evt._argsOffset) + index;
+            if (argIndex >= thread._args.size()) {
+                break;
+            }
+
+            const EventArg& arg = thread._args[argIndex];
+            if (arg._key && strcmp(arg._key, key) == 0) {
+                return &arg;
+            }
+        }
+
+        return nullptr;
+    }
+
+    std::vector<ArgBucketStats> AnalyzeEventsByArg(const std::vector<Thread>& threads, const char* eventName, const char* key, double bucketWidth)
+    {
+        PERFORMAN_ASSERT(bucketWidth > 0.0);
+        std::map<int64_t, std::vector<PortableNano>> durationsByBucket;
+        std::map<int64_t, uint64_t> callsByBucket;
+
+        for (const Thread& thread : threads)
+        {
+            for (const Event& evt : thread._events)
+            {
+                if (evt._argsCount == 0 || evt._name == nullptr || strcmp(evt._name, eventName) != 0) {
+                    continue;
+                }
+
+                const EventArg* arg = FindEventArg(thread, evt, key);
+                if (arg == nullptr || !arg->IsNumeric()) {
+                    continue;
+                }
+
+                int64_t bucket = static_cast<int64_t>(std::floor(arg->AsDouble() / bucketWidth));
+                durationsByBucket[bucket].push_back(evt._end - evt._start);
+                callsByBucket[bucket] += evt._weight;
+            }
+        }
+
+        std::vector<ArgBucketStats> result;
+        result.reserve(durationsByBucket.size());
+
+        for (auto& [bucket, durations] : durationsByBucket)
+        {
+            ArgBucketStats& stats = result.emplace_back();
+            stats._bucket = static_cast<double>(bucket) * bucketWidth;
+            stats._count = callsByBucket[bucket];
+            stats._p50 = Percentile(durations, 0.50);
+            stats._p99 = Percentile(durations, 0.99);
+            stats._max = durations.back();
+        }
+
+        return result;
+    }
+
+    using ScopeSpan = std::pair<PortableTimePoint, PortableTimePoint>;
+
+    // Scopes of a thread nest, counts the scopes nested in each one. Also returns their spans by start.
+    template <class Scope>
+    static void CountNestedScopes(const std::vector<Scope>& scopes, std::vector<uint32_t>& nested, std::vector<ScopeSpan>& spans)
+    {
+        // Parents first: by start, the longest first on ties
+        std::vector<uint32_t> order(scopes.size());
+        for (uint32_t index = 0; index < order.size(); index++) {
+            order[index] = index;
+        }
+        std::sort(order.begin(), order.end(), [&scopes](uint32_t lhs, uint32_t rhs) {
+            return scopes[lhs]._start != scopes[rhs]._start ? scopes[lhs]._start < scopes[rhs]._start : scopes[lhs]._end > scopes[rhs]._end;
+        });
+
+        std::vector<uint32_t> stack;
+        nested.assign(scopes.size(), 0);
+        spans.clear();
+
+        for (uint32_t index : order)
+        {
+            const Scope& scope = scopes[index];
+            while (!stack.empty() && scopes[stack.back()]._end < scope._end) {
+                stack.pop_back();
+            }
+
+            for (uint32_t ancestor : stack) {
+                nested[ancestor]++;
+            }
+
+            stack.push_back(index);
+            spans.emplace_back(scope._start, scope._end);
+        }
+    }
+
+    // Scopes of the other kind nested in [start, end]: they start within it, minus those starting
+    // at the same time that enclose it
+    static int64_t CountNestedIn(const std::vector<ScopeSpan>& spans, PortableTimePoint start, PortableTimePoint end)
+    {
+        auto byStart = [](const ScopeSpan& span, PortableTimePoint time) { return span.first < time; };
+        auto first = std::lower_bound(spans.begin(), spans.end(), start, byStart);
+        auto last = std::lower_bound(first, spans.end(), end, byStart);
+
+        int64_t count = last - first;
+        for (auto it = first; it != last && it->first == start; ++it)
+        {
+            if (it->second > end) {
+                count--;
+            }
+        }
+        return count;
+    }
+
+    void CompensateOverhead(std::vector<Thread>& threads, const CaptureHeader& header)
+    {
+        if (header._eventOverhead <= PortableNano(0) && header._frameOverhead <= PortableNano(0)) {
+            return;
+        }
+
+        std::vector<uint32_t> nestedEvents;
+        std::vector<uint32_t> nestedFrames;
+        std::vector<ScopeSpan> eventSpans;
+        std::vector<ScopeSpan> frameSpans;
+
+        for (Thread& thread : threads)
+        {
+            // Counted on the original times, before any scope is shortened
+            CountNestedScopes(thread._events, nestedEvents, eventSpans);
+            CountNestedScopes(thread._frames, nestedFrames, frameSpans);
+
+            for (uint32_t index = 0; index < thread._frames.size(); index++)
+            {
+                Frame& frame = thread._frames[index];
+                PortableNano overhead = header._eventOverhead * CountNestedIn(eventSpans, frame._start, frame._end)
+                    + header._frameOverhead * nestedFrames[index];
+                frame._end -= std::min(overhead, frame._end - frame._start);
+            }
+
+            for (uint32_t index = 0; index < thread._events.size(); index++)
+            {
+                Event& evt = thread._events[index];
+                PortableNano overhead = header._eventOverhead * nestedEvents[index]
+                    + header._frameOverhead * CountNestedIn(frameSpans, evt._start, evt._end);
+                evt._end -= std::min(overhead, evt._end - evt._start);
+            }
+        }
+    }
+
+    FramePacingStats AnalyzeFramePacing(const Thread& thread, PortableNano targetFrameTime, size_t maxCulprits)
+    {
+        PERFORMAN_ASSERT(targetFrameTime > PortableNano(0));
+
+        FramePacingStats stats;
+        const std::vector<Frame>& frames = thread._frames;
+        const std::vector<Event>& events = thread._events;
+        if (frames.empty()) {
+            return stats;
+        }
+
+        std::vector<PortableNano> frameTimes;
+        frameTimes.reserve(frames.size());
+
+        double mean = 0.0;
+        PortableNano totalOversleep{ 0 };
+        uint64_t waits = 0;
+
+        for (const Frame& frame : frames)
+        {
+            frameTimes.push_back(frame._end - frame._start + frame._gap);
+            mean += static_cast<double>(frameTimes.back().count());
+
+            if (frame._waitIntended > PortableNano(0))
+            {
+                PortableNano oversleep = std::max(frame._waitActual - frame._waitIntended, PortableNano(0));
+                totalOversleep += oversleep;
+                stats._maxOversleep = std::max(stats._maxOversleep, oversleep);
+                waits++;
+            }
+        }
+
+        mean /= static_cast<double>(frames.size());
+        double variance = 0.0;
+        for (PortableNano frameTime : frameTimes) {
+            variance += (static_cast<double>(frameTime.count()) - mean) * (static_cast<double>(frameTime.count()) - mean);
+        }
+
+        stats._frames = frames.size();
+        stats._mean = PortableNano(std::llround(mean));
+        stats._variance = variance / static_cast<double>(frames.size()) / 1e12;
+        stats._meanOversleep = waits > 0 ? totalOversleep / static_cast<int64_t>(waits) : PortableNano(0);
+
+        // Time per event name in each frame, events belong to the frame they start in
+        struct NameTotals {
+            const char* _name = nullptr;
+            std::vector<PortableNano> _perFrame;
+            PortableNano _median{ 0 };
+        };
+        std::unordered_map<std::string_view, NameTotals> totalsByName;
+
+        std::vector<uint32_t> order(events.size());
+        for (uint32_t index = 0; index < order.size(); index++) {
+            order[index] = index;
+        }
+        std::sort(order.begin(), order.end(), [&events](uint32_t lhs, uint32_t rhs) { return events[lhs]._start < events[rhs]._start; });
+
+        std::vector<PortableTimePoint> starts;
+        starts.reserve(order.size());
+        for (uint32_t index : order) {
+            starts.push_back(events[index]._start);
+        }
+
+        for (size_t frameIndex = 0; frameIndex < frames.size(); frameIndex++)
+        {
+            size_t first = static_cast<size_t>(std::lower_bound(starts.begin(), starts.end(), frames[frameIndex]._start) - starts.begin());
+            size_t last = static_cast<size_t>(std::lower_bound(starts.begin() + first, starts.end(), frames[frameIndex]._end) - starts.begin());
+
+            for (size_t index = first; index < last; index++)
+            {
+                const Event& evt = events[order[index]];
+                NameTotals& totals = totalsByName[evt._name ? evt._name : ""];
+                if (totals._perFrame.empty())
+                {
+                    totals._name = evt._name;
+                    totals._perFrame.resize(frames.size());
+                }
+                totals._perFrame[frameIndex] += (evt._end - evt._start) * evt._weight;
+            }
+        }
+
+        std::vector<PortableNano> sorted;
+        for (auto& [name, totals] : totalsByName)
+        {
+            sorted = totals._perFrame;
+            totals._median = Percentile(sorted, 0.50);
+        }
+
+        for (size_t frameIndex = 0; frameIndex < frames.size(); frameIndex++)
+        {
+            PortableNano frameTime = frameTimes[frameIndex];
+            if (frameTime <= targetFrameTime) {
+                continue;
+            }
+
+            const Frame& frame = frames[frameIndex];
+            LateFrame& late = stats._lateFrames.emplace_back();
+            late._frameIdx = frame._frameIdx;
+            late._frameTime = frameTime;
+            late._oversleep = std::max(frame._waitActual - frame._waitIntended, PortableNano(0));
+            stats._droppedFrames += static_cast<uint64_t>((frameTime - PortableNano(1)) / targetFrameTime);
+
+            for (const auto& [name, totals] : totalsByName)
+            {
+                PortableNano excess = totals._perFrame[frameIndex] - totals._median;
+                if (excess > PortableNano(0)) {
+                    late._culprits.push_back(FrameCulprit{ totals._name, excess });
+                }
+            }
+
+            size_t culprits = std::min(maxCulprits, late._culprits.size());
+            std::partial_sort(late._culprits.begin(), late._culprits.begin() + culprits, late._culprits.end(),
+                [](const FrameCulprit& lhs, const FrameCulprit& rhs) { return lhs._excess > rhs._excess; });
+            late._culprits.resize(culprits);
+        }
+
+        stats._p99 = Percentile(frameTimes, 0.99);
+        stats._max = frameTimes.back();
+        return stats;
+    }
+
+    ////////////////////////////////// Serialization //////////////////////////////////
+
+    Stream::Stream(Allocator* allocator)
+        : _allocator(allocator)
+    {
+    }
+
+    Stream::Stream(Allocator* allocator, uint8_t* buffer, size_t size)
+        : _allocator(allocator)
+        , _size(size)
+    {
+        _buffer = (uint8_t*)PERFORMAN_ALLOCATE(*_allocator, size);
+        memcpy(_buffer, buffer, size);
+    }
+
+    Stream::~Stream()
+    {
+        Clear();
+    }
+
+    void Stream::Resize()
+    {
+        // 1. Reallocate new internal buffer
+        constexpr size_t firstAllocDefaultSize = 1024; // 1024 bytes (1KB)
+
+        size_t allocSize = _size > 0 ? _size * 2 : firstAllocDefaultSize;
+        uint8_t* buf = (uint8_t*)PERFORMAN_ALLOCATE(*_allocator, allocSize);
+
+        // 2. Copy previous buffer data
+        if (_buffer) {
+            memcpy(buf, _buffer, _size);
+        }
+
+        _size = allocSize;
+
+        // 3. Swap internal buffer & delete previous
+        uint8_t* prevBuf = _buffer;
+        _buffer = buf;
+
+        delete[] prevBuf;
+    }
+
+    void Stream::Clear()
+    {
+        _size = 0;
+        _offset = 0;
+
+        delete[] _buffer;
+        _buffer = nullptr;
+    }
+
+    void WriteStream::SerializeBytes(void* value, size_t size)
+    {
+        if (_size - _offset < size) {
+            Resize();
+        }
+        memcpy(&_buffer[_offset], value, size);
+        _offset += size;
+    }
+
+    void ReadStream::SerializeBytes(void* value, size_t size)
+    {
+        memcpy(value, &_buffer[_offset], size);
+        _offset += size;
+    }
+
+    ////////////////////////////////// Columnar //////////////////////////////////
+
+    ColumnarCapture ColumnarCapture::FromThreads(const std::vector<Thread>& threads)
+    {
+        ColumnarCapture capture;
+        std::unordered_map<std::string_view, uint32_t> nameIds;
+        std::vector<uint32_t> order;
+
+        capture._threads.reserve(threads.size());
+        for (const Thread& thread : threads)
+        {
+            ColumnarThread& columns = capture._threads.emplace_back();
+            columns._name = thread._name;
+            columns._processId = thread._processId;
+
+            // Events are recorded when they end, columns are sorted by start
+            order.resize(thread._events.size());
+            for (uint32_t index = 0; index < order.size(); index++) {
+                order[index] = index;
+            }
+            std::stable_sort(order.begin(), order.end(), [&thread](uint32_t lhs, uint32_t rhs) {
+                return thread._events[lhs]._start < thread._events[rhs]._start;
+            });
+
+            columns._starts.reserve(order.size());
+            columns._durations.reserve(order.size());
+            columns._nameIds.reserve(order.size());
+            columns._weights.reserve(order.size());
+
+            for (uint32_t index : order)
+            {
+                const Event& evt = thread._events[index];
+                auto [itName, inserted] = nameIds.emplace(evt._name ? evt._name : "", static_cast<uint32_t>(capture._names.size()));
+                if (inserted) {
+                    capture._names.push_back(evt._name ? evt._name : "");
+                }
+
+                columns._starts.push_back(evt._start.time_since_epoch().count());
+                columns._durations.push_back((evt._end - evt._start).count());
+                columns._nameIds.push_back(itName->second);
+                columns._weights.push_back(evt._weight);
+            }
+
+            columns._frameStarts.reserve(thread._frames.size());
+            columns._frameEnds.reserve(thread._frames.size());
+            for (const Frame& frame : thread._frames)
+            {
+                columns._frameStarts.push_back(frame._start.time_since_epoch().count());
+                columns._frameEnds.push_back(frame._end.time_since_epoch().count());
+            }
+        }
+
+        return capture;
+    }
+
+    uint32_t ColumnarCapture::FindName(const char* name) const
+    {
+        for (uint32_t index = 0; index < _names.size(); index++)
+        {
+            if (strcmp(_names[index], name) == 0) {
+                return index;
+            }
+        }
+
+        return InvalidNameId;
+    }
+
+    // Scalar kernels, also used for the tails of the vectorized ones. Sums accumulate.
+
+    static void ComputeDurationsScalar(const int64_t* starts, const int64_t* ends, int64_t* durations, size_t count)
+    {
+        for (size_t index = 0; index < count; index++) {
+            durations[index] = ends[index] - starts[index];
+        }
+    }
+
+    static int64_t SumDurationsScalar(const int64_t* durations, size_t count)
+    {
+        int64_t total = 0;
+        for (size_t index = 0; index < count; index++) {
+            total += durations[index];
+        }
+        return total;
+    }
+
+    static int64_t SumDurationsWeightedScalar(const int64_t* durations, const uint32_t* weights, size_t count)
+    {
+        int64_t total = 0;
+        for (size_t index = 0; index < count; index++) {
+            total += durations[index] * static_cast<int64_t>(weights[index]);
+        }
+        return total;
+    }
+
+    static void SumDurationsByNameScalar(const uint32_t* nameIds, const int64_t* durations, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        for (size_t index = 0; index < count; index++)
+        {
+            if (nameIds[index] == nameId)
+            {
+                matches++;
+                total += durations[index];
+            }
+        }
+    }
+
+    static void SumDurationsByNameWeightedScalar(const uint32_t* nameIds, const int64_t* durations, const uint32_t* weights, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        for (size_t index = 0; index < count; index++)
+        {
+            if (nameIds[index] == nameId)
+            {
+                matches += weights[index];
+                total += durations[index] * static_cast<int64_t>(weights[index]);
+            }
+        }
+    }
+
+    static void FilterByNameScalar(const uint32_t* nameIds, size_t first, size_t count, uint32_t nameId, std::vector<uint32_t>& indices)
+    {
+        for (size_t index = first; index < count; index++)
+        {
+            if (nameIds[index] == nameId) {
+                indices.push_back(static_cast<uint32_t>(index));
+            }
+        }
+    }
+
+    static void HistogramDurationsScalar(const int64_t* durations, const uint32_t* weights, size_t count, int64_t binWidth, uint64_t* bins, size_t binCount)
+    {
+        for (size_t index = 0; index < count; index++)
+        {
+            int64_t duration = durations[index];
+            uint64_t bin = duration > 0 ? static_cast<uint64_t>(duration / binWidth) : 0;
+            bins[std::min<uint64_t>(bin, binCount - 1)] += weights != nullptr ? weights[index] : 1;
+        }
+    }
+
+    // Vectorized histograms compute bins with a multiply by the reciprocal and an exact 32x32 bits
+    // product correction, which bounds the bin width and count
+    static bool HistogramFitsSimd(int64_t binWidth, size_t binCount)
+    {
+        return binWidth < (1ll << 32) && binCount < (1ull << 24);
+    }
+
+#if defined(PERFORMAN_AVX2)
+    PERFORMAN_AVX2_TARGET static void ComputeDurationsAvx2(const int64_t* starts, const int64_t* ends, int64_t* durations, size_t count)
+    {
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            __m256i start = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(starts + index));
+            __m256i end = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ends + index));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(durations + index), _mm256_sub_epi64(end, start));
+        }
+
+        ComputeDurationsScalar(starts + index, ends + index, durations + index, count - index);
+    }
+
+    PERFORMAN_AVX2_TARGET static int64_t ReduceAvx2(__m256i value)
+    {
+        alignas(32) int64_t lanes[4];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), value);
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    PERFORMAN_AVX2_TARGET static int64_t SumDurationsAvx2(const int64_t* durations, size_t count)
+    {
+        __m256i sum0 = _mm256_setzero_si256();
+        __m256i sum1 = _mm256_setzero_si256();
+
+        size_t index = 0;
+        for (; index + 8 <= count; index += 8)
+        {
+            sum0 = _mm256_add_epi64(sum0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(durations + index)));
+            sum1 = _mm256_add_epi64(sum1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(durations + index + 4)));
+        }
+
+        return ReduceAvx2(_mm256_add_epi64(sum0, sum1)) + SumDurationsScalar(durations + index, count - index);
+    }
+
+    // Products modulo 2^64 of the int64 durations by the weights zero extended in the 64 bits lanes
+    PERFORMAN_AVX2_TARGET static __m256i MultiplyWeightsAvx2(__m256i durations, __m256i weights)
+    {
+        __m256i low = _mm256_mul_epu32(durations, weights);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(durations, 32), weights);
+        return _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+
+    PERFORMAN_AVX2_TARGET static int64_t SumDurationsWeightedAvx2(const int64_t* durations, const uint32_t* weights, size_t count)
+    {
+        __m256i sum = _mm256_setzero_si256();
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            __m256i weight = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + index)));
+            __m256i duration = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(durations + index));
+            sum = _mm256_add_epi64(sum, MultiplyWeightsAvx2(duration, weight));
+        }
+
+        return ReduceAvx2(sum) + SumDurationsWeightedScalar(durations + index, weights + index, count - index);
+    }
+
+    PERFORMAN_AVX2_TARGET static void SumDurationsByNameAvx2(const uint32_t* nameIds, const int64_t* durations, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        const __m256i id = _mm256_set1_epi64x(nameId);
+        __m256i sum = _mm256_setzero_si256();
+        __m256i hits = _mm256_setzero_si256();
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            __m256i ids = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(nameIds + index)));
+            __m256i mask = _mm256_cmpeq_epi64(ids, id);
+            __m256i duration = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(durations + index));
+
+            sum = _mm256_add_epi64(sum, _mm256_and_si256(mask, duration));
+            hits = _mm256_sub_epi64(hits, mask); // Mask lanes are -1
+        }
+
+        matches += static_cast<uint64_t>(ReduceAvx2(hits));
+        total += ReduceAvx2(sum);
+        SumDurationsByNameScalar(nameIds + index, durations + index, count - index, nameId, matches, total);
+    }
+
+    PERFORMAN_AVX2_TARGET static void SumDurationsByNameWeightedAvx2(const uint32_t* nameIds, const int64_t* durations, const uint32_t* weights, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        const __m256i id = _mm256_set1_epi64x(nameId);
+        __m256i sum = _mm256_setzero_si256();
+        __m256i hits = _mm256_setzero_si256();
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            __m256i ids = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(nameIds + index)));
+            __m256i mask = _mm256_cmpeq_epi64(ids, id);
+            __m256i weight = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(weights + index)));
+            __m256i duration = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(durations + index));
+
+            sum = _mm256_add_epi64(sum, _mm256_and_si256(mask, MultiplyWeightsAvx2(duration, weight)));
+            hits = _mm256_add_epi64(hits, _mm256_and_si256(mask, weight));
+        }
+
+        matches += static_cast<uint64_t>(ReduceAvx2(hits));
+        total += ReduceAvx2(sum);
+        SumDurationsByNameWeightedScalar(nameIds + index, durations + index, weights + index, count - index, nameId, matches, total);
+    }
+
+    PERFORMAN_AVX2_TARGET static void FilterByNameAvx2(const uint32_t* nameIds, size_t count, uint32_t nameId, std::vector<uint32_t>& indices)
+    {
+        const __m256i id = _mm256_set1_epi32(static_cast<int>(nameId));
+
+        size_t index = 0;
+        for (; index + 8 <= count; index += 8)
+        {
+            __m256i ids = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(nameIds + index));
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(ids, id))));
+
+            while (mask != 0)
+            {
+                indices.push_back(static_cast<uint32_t>(index + std::countr_zero(mask)));
+                mask &= mask - 1;
+            }
+        }
+
+        FilterByNameScalar(nameIds, index, count, nameId, indices);
+    }
+
+    PERFORMAN_AVX2_TARGET static void HistogramDurationsAvx2(const int64_t* durations, const uint32_t* weights, size_t count, int64_t binWidth, uint64_t* bins, size_t binCount)
+    {
+        // Exact int64 <-> double conversions for 0 <= value < 2^52 through the 2^52 exponent
+        const __m256i magicBits = _mm256_set1_epi64x(0x4330000000000000ll);
+        const __m256d magic = _mm256_castsi256_pd(magicBits);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi64x(-1);
+        const __m256i limit = _mm256_set1_epi64x((1ll << 52) - 1);
+        const __m256i width = _mm256_set1_epi64x(binWidth);
+        const __m256i lastBin = _mm256_set1_epi64x(static_cast<int64_t>(binCount - 1));
+        const __m256d inverseWidth = _mm256_set1_pd(1.0 / static_cast<double>(binWidth));
+        const __m256d binCountD = _mm256_set1_pd(static_cast<double>(binCount));
+
+        alignas(32) int64_t lanes[4];
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(durations + index));
+            value = _mm256_andnot_si256(_mm256_cmpgt_epi64(zero, value), value);
+            value = _mm256_blendv_epi8(value, limit, _mm256_cmpgt_epi64(value, limit));
+
+            __m256d valueD = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(value, magicBits)), magic);
+            __m256d quotientD = _mm256_min_pd(_mm256_floor_pd(_mm256_mul_pd(valueD, inverseWidth)), binCountD);
+            __m256i quotient = _mm256_xor_si256(_mm256_castpd_si256(_mm256_add_pd(quotientD, magic)), magicBits);
+
+            // The reciprocal can be one off, fix it with exact products
+            __m256i product = _mm256_mul_epu32(quotient, width);
+            __m256i over = _mm256_cmpgt_epi64(product, value);
+            quotient = _mm256_add_epi64(quotient, over);
+            product = _mm256_sub_epi64(product, _mm256_and_si256(over, width));
+
+            __m256i below = _mm256_cmpgt_epi64(_mm256_add_epi64(product, width), value);
+            quotient = _mm256_sub_epi64(quotient, _mm256_andnot_si256(below, ones));
+            quotient = _mm256_blendv_epi8(quotient, lastBin, _mm256_cmpgt_epi64(quotient, lastBin));
+
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), quotient);
+            for (size_t lane = 0; lane < 4; lane++) {
+                bins[lanes[lane]] += weights != nullptr ? weights[index + lane] : 1;
+            }
+        }
+
+        HistogramDurationsScalar(durations + index, weights != nullptr ? weights + index : nullptr, count - index, binWidth, bins, binCount);
+    }
+#endif
+
+#if defined(PERFORMAN_NEON)
+    static void ComputeDurationsNeon(const int64_t* starts, const int64_t* ends, int64_t* durations, size_t count)
+    {
+        size_t index = 0;
+        for (; index + 2 <= count; index += 2) {
+            vst1q_s64(durations + index, vsubq_s64(vld1q_s64(ends + index), vld1q_s64(starts + index)));
+        }
+
+        ComputeDurationsScalar(starts + index, ends + index, durations + index, count - index);
+    }
+
+    static int64_t SumDurationsNeon(const int64_t* durations, size_t count)
+    {
+        int64x2_t sum0 = vdupq_n_s64(0);
+        int64x2_t sum1 = vdupq_n_s64(0);
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            sum0 = vaddq_s64(sum0, vld1q_s64(durations + index));
+            sum1 = vaddq_s64(sum1, vld1q_s64(durations + index + 2));
+        }
+
+        return vaddvq_s64(vaddq_s64(sum0, sum1)) + SumDurationsScalar(durations + index, count - index);
+    }
+
+    // Products modulo 2^64 of the int64 durations by the weights
+    static int64x2_t MultiplyWeightsNeon(int64x2_t durations, uint32x2_t weights)
+    {
+        uint64x2_t value = vreinterpretq_u64_s64(durations);
+        uint64x2_t low = vmull_u32(vmovn_u64(value), weights);
+        uint64x2_t high = vmull_u32(vshrn_n_u64(value, 32), weights);
+        return vreinterpretq_s64_u64(vaddq_u64(low, vshlq_n_u64(high, 32)));
+    }
+
+    static int64_t SumDurationsWeightedNeon(const int64_t* durations, const uint32_t* weights, size_t count)
+    {
+        int64x2_t sum = vdupq_n_s64(0);
+
+        size_t index = 0;
+        for (; index + 2 <= count; index += 2) {
+            sum = vaddq_s64(sum, MultiplyWeightsNeon(vld1q_s64(durations + index), vld1_u32(weights + index)));
+        }
+
+        return vaddvq_s64(sum) + SumDurationsWeightedScalar(durations + index, weights + index, count - index);
+    }
+
+    static void SumDurationsByNameNeon(const uint32_t* nameIds, const int64_t* durations, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        const uint32x4_t id = vdupq_n_u32(nameId);
+        int64x2_t sum = vdupq_n_s64(0);
+        int64x2_t hits = vdupq_n_s64(0);
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            int32x4_t equal = vreinterpretq_s32_u32(vceqq_u32(vld1q_u32(nameIds + index), id));
+            // Sign extension keeps mask lanes all ones
+            int64x2_t maskLow = vmovl_s32(vget_low_s32(equal));
+            int64x2_t maskHigh = vmovl_s32(vget_high_s32(equal));
+
+            sum = vaddq_s64(sum, vandq_s64(maskLow, vld1q_s64(durations + index)));
+            sum = vaddq_s64(sum, vandq_s64(maskHigh, vld1q_s64(durations + index + 2)));
+            hits = vsubq_s64(hits, vaddq_s64(maskLow, maskHigh));
+        }
+
+        matches += static_cast<uint64_t>(vaddvq_s64(hits));
+        total += vaddvq_s64(sum);
+        SumDurationsByNameScalar(nameIds + index, durations + index, count - index, nameId, matches, total);
+    }
+
+    static void SumDurationsByNameWeightedNeon(const uint32_t* nameIds, const int64_t* durations, const uint32_t* weights, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        const uint32x4_t id = vdupq_n_u32(nameId);
+        int64x2_t sum = vdupq_n_s64(0);
+        int64x2_t hits = vdupq_n_s64(0);
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            int32x4_t equal = vreinterpretq_s32_u32(vceqq_u32(vld1q_u32(nameIds + index), id));
+            int64x2_t maskLow = vmovl_s32(vget_low_s32(equal));
+            int64x2_t maskHigh = vmovl_s32(vget_high_s32(equal));
+            uint32x4_t weight = vld1q_u32(weights + index);
+            int64x2_t weightLow = vreinterpretq_s64_u64(vmovl_u32(vget_low_u32(weight)));
+            int64x2_t weightHigh = vreinterpretq_s64_u64(vmovl_u32(vget_high_u32(weight)));
+
+            sum = vaddq_s64(sum, vandq_s64(maskLow, MultiplyWeightsNeon(vld1q_s64(durations + index), vget_low_u32(weight))));
+            sum = vaddq_s64(sum, vandq_s64(maskHigh, MultiplyWeightsNeon(vld1q_s64(durations + index + 2), vget_high_u32(weight))));
+            hits = vaddq_s64(hits, vaddq_s64(vandq_s64(maskLow, weightLow), vandq_s64(maskHigh, weightHigh)));
+        }
+
+        matches += static_cast<uint64_t>(vaddvq_s64(hits));
+        total += vaddvq_s64(sum);
+        SumDurationsByNameWeightedScalar(nameIds + index, durations + index, weights + index, count - index, nameId, matches, total);
+    }
+
+    static void FilterByNameNeon(const uint32_t* nameIds, size_t count, uint32_t nameId, std::vector<uint32_t>& indices)
+    {
+        const uint32x4_t id = vdupq_n_u32(nameId);
+
+        size_t index = 0;
+        for (; index + 4 <= count; index += 4)
+        {
+            if (vmaxvq_u32(vceqq_u32(vld1q_u32(nameIds + index), id)) != 0) {
+                FilterByNameScalar(nameIds, index, index + 4, nameId, indices);
+            }
+        }
+
+        FilterByNameScalar(nameIds, index, count, nameId, indices);
+    }
+
+    static void HistogramDurationsNeon(const int64_t* durations, const uint32_t* weights, size_t count, int64_t binWidth, uint64_t* bins, size_t binCount)
+    {
+        const int64x2_t zero = vdupq_n_s64(0);
+        const uint64x2_t ones = vdupq_n_u64(UINT64_MAX);
+        const int64x2_t limit = vdupq_n_s64((1ll << 52) - 1);
+        const int64x2_t width = vdupq_n_s64(binWidth);
+        const int64x2_t lastBin = vdupq_n_s64(static_cast<int64_t>(binCount - 1));
+        const uint32x2_t width32 = vdup_n_u32(static_cast<uint32_t>(binWidth));
+        const float64x2_t inverseWidth = vdupq_n_f64(1.0 / static_cast<double>(binWidth));
+        const float64x2_t binCountD = vdupq_n_f64(static_cast<double>(binCount));
+
+        size_t index = 0;
+        for (; index + 2 <= count; index += 2)
+        {
+            int64x2_t value = vld1q_s64(durations + index);
+            value = vbslq_s64(vcltq_s64(value, zero), zero, value);
+            value = vbslq_s64(vcgtq_s64(value, limit), limit, value);
+
+            float64x2_t quotientD = vminq_f64(vrndmq_f64(vmulq_f64(vcvtq_f64_s64(value), inverseWidth)), binCountD);
+            int64x2_t quotient = vcvtq_s64_f64(quotientD);
+
+            // The reciprocal can be one off, fix it with exact products
+            int64x2_t product = vreinterpretq_s64_u64(vmull_u32(vmovn_u64(vreinterpretq_u64_s64(quotient)), width32));
+            int64x2_t over = vreinterpretq_s64_u64(vcgtq_s64(product, value));
+            quotient = vaddq_s64(quotient, over);
+            product = vsubq_s64(product, vandq_s64(over, width));
+
+            uint64x2_t below = vcgtq_s64(vaddq_s64(product, width), value);
+            quotient = vsubq_s64(quotient, vreinterpretq_s64_u64(veorq_u64(below, ones)));
+            quotient = vbslq_s64(vcgtq_s64(quotient, lastBin), lastBin, quotient);
+
+            bins[vgetq_lane_s64(quotient, 0)] += weights != nullptr ? weights[index] : 1;
+            bins[vgetq_lane_s64(quotient, 1)] += weights != nullptr ? weights[index + 1] : 1;
+        }
+
+        HistogramDurationsScalar(durations + index, weights != nullptr ? weights + index : nullptr, count - index, binWidth, bins, binCount);
+    }
+#endif
+
+    static SimdLevel DetectSimdLevel()
+    {
+#if defined(PERFORMAN_AVX2) && defined(_MSC_VER)
+        return SimdAvx2;
+#elif defined(PERFORMAN_AVX2)
+        return __builtin_cpu_supports("avx2") ? SimdAvx2 : SimdScalar;
+#elif defined(PERFORMAN_NEON)
+        return SimdNeon;
+#else
+        return SimdScalar;
+#endif
+    }
+
+    static std::atomic<SimdLevel>& SimdLevelState()
+    {
+        static std::atomic<SimdLevel> level{ DetectSimdLevel() };
+        return level;
+    }
+
+    SimdLevel GetSimdLevel()
+    {
+        return SimdLevelState().load(std::memory_order_relaxed);
+    }
+
+    bool SetSimdLevel(SimdLevel level)
+    {
+        if (level != SimdScalar && level != DetectSimdLevel()) {
+            return false;
+        }
+
+        SimdLevelState().store(level, std::memory_order_relaxed);
+        return true;
+    }
+
+    void ComputeDurations(const int64_t* starts, const int64_t* ends, int64_t* durations, size_t count)
+    {
+        switch (GetSimdLevel())
+        {
+#if defined(PERFORMAN_AVX2)
+        case SimdAvx2:
+            ComputeDurationsAvx2(starts, ends, durations, count);
+            return;
+#endif
+#if defined(PERFORMAN_NEON)
+        case SimdNeon:
+            ComputeDurationsNeon(starts, ends, durations, count);
+            return;
+#endif
+        default:
+            ComputeDurationsScalar(starts, ends, durations, count);
+            return;
+        }
+    }
+
+    static int64_t SumDurations(const int64_t* durations, const uint32_t* weights, size_t count)
+    {
+        switch (GetSimdLevel())
+        {
+#if defined(PERFORMAN_AVX2)
+        case SimdAvx2:
+            return weights != nullptr ? SumDurationsWeightedAvx2(durations, weights, count) : SumDurationsAvx2(durations, count);
+#endif
+#if defined(PERFORMAN_NEON)
+        case SimdNeon:
+            return weights != nullptr ? SumDurationsWeightedNeon(durations, weights, count) : SumDurationsNeon(durations, count);
+#endif
+        default:
+            return weights != nullptr ? SumDurationsWeightedScalar(durations, weights, count) : SumDurationsScalar(durations, count);
+        }
+    }
+
+    void SumDurationsByName(const uint32_t* nameIds, const int64_t* durations, const uint32_t* weights, size_t count, uint32_t nameId, uint64_t& matches, int64_t& total)
+    {
+        matches = 0;
+        total = 0;
+
+        switch (GetSimdLevel())
+        {
+#if defined(PERFORMAN_AVX2)
+        case SimdAvx2:
+            if (weights != nullptr) {
+                SumDurationsByNameWeightedAvx2(nameIds, durations, weights, count, nameId, matches, total);
+            } else {
+                SumDurationsByNameAvx2(nameIds, durations, count, nameId, matches, total);
+            }
+            return;
+#endif
+#if defined(PERFORMAN_NEON)
+        case SimdNeon:
+            if (weights != nullptr) {
+                SumDurationsByNameWeightedNeon(nameIds, durations, weights, count, nameId, matches, total);
+            } else {
+                SumDurationsByNameNeon(nameIds, durations, count, nameId, matches, total);
+            }
+            return;
+#endif
+        default:
+            if (weights != nullptr) {
+                SumDurationsByNameWeightedScalar(nameIds, durations, weights, count, nameId, matches, total);
+            } else {
+                SumDurationsByNameScalar(nameIds, durations, count, nameId, matches, total);
+            }
+            return;
+        }
+    }
+
+    void FilterByName(const uint32_t* nameIds, size_t count, uint32_t nameId, std::vector<uint32_t>& indices)
+    {
+        switch (GetSimdLevel())
+        {
+#if defined(PERFORMAN_AVX2)
+        case SimdAvx2:
+            FilterByNameAvx2(nameIds, count, nameId, indices);
+            return;
+#endif
+#if defined(PERFORMAN_NEON)
+        case SimdNeon:
+            FilterByNameNeon(nameIds, count, nameId, indices);
+            return;
+#endif
+        default:
+            FilterByNameScalar(nameIds, 0, count, nameId, indices);
+            return;
+        }
+    }
+
+    void HistogramDurations(const int64_t* durations, const uint32_t* weights, size_t count, int64_t binWidth, uint64_t* bins, size_t binCount)
+    {
+        PERFORMAN_ASSERT(binWidth > 0 && binCount > 0);
+
+        SimdLevel level = HistogramFitsSimd(binWidth, binCount) ? GetSimdLevel() : SimdScalar;
+        switch (level)
+        {
+#if defined(PERFORMAN_AVX2)
+        case SimdAvx2:
+            HistogramDurationsAvx2(durations, weights, count, binWidth, bins, binCount);
+            return;
+#endif
+#if defined(PERFORMAN_NEON)
+        case SimdNeon:
+            HistogramDurationsNeon(durations, weights, count, binWidth, bins, binCount);
+            return;
+#endif
+        default:
+            HistogramDurationsScalar(durations, weights, count, binWidth, bins, binCount);
+            return;
+        }
+    }
+
+    void SumDurationsPerFrame(const int64_t* starts, const int64_t* durations, const uint32_t* weights, const uint32_t* nameIds, size_t count,
+        const int64_t* frameStarts, const int64_t* frameEnds, size_t frameCount, uint32_t nameId, int64_t* totals)
+    {
+        for (size_t frame = 0; frame < frameCount; frame++)
+        {
+            size_t first = static_cast<size_t>(std::lower_bound(starts, starts + count, frameStarts[frame]) - starts);
+            size_t last = static_cast<size_t>(std::lower_bound(starts + first, starts + count, frameEnds[frame]) - starts);
+            const uint32_t* frameWeights = weights != nullptr ? weights + first : nullptr;
+
+            if (nameId == ColumnarCapture::InvalidNameId)
+            {
+                totals[frame] = SumDurations(durations + first, frameWeights, last - first);
+            }
+            else
+            {
+                uint64_t matches = 0;
+                SumDurationsByName(nameIds + first, durations + first, frameWeights, last - first, nameId, matches, totals[frame]);
+            }
+        }
     }
 }
@@ -2,14 +2,37 @@
 
 #include "performan.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 void Assert(const char* condition, const char* filename, const char* line, int linenumber) {
     std::cout << "[Assert]: " << condition << " (" << filename << ": " << line << "::" << linenumber << ")" << std::endl;
 }
 
+std::vector<Performan::Thread> ReadCapture(const std::vector<uint8_t>& capture, Performan::CaptureHeader* header = nullptr) {
+    Performan::ReadStream rStream(&Performan::GetDefaultAllocator(), const_cast<uint8_t*>(capture.data()), capture.size());
+    std::vector<Performan::Thread> threads;
+
+    Performan::CaptureHeader captureHeader;
+    captureHeader.Serialize(rStream);
+    EXPECT_TRUE(captureHeader.IsValid());
+    if (header) {
+        *header = captureHeader;
+    }
+
+    while (rStream.Offset() < capture.size()) {
+        threads.emplace_back().Serialize(rStream);
+    }
+
+    return threads;
+}
+
 class PerformanTest : public testing::Test {
 protected:
     void SetUp() override {
@@ -231,3 +254,1503 @@ TEST_F(PerformanTest, TestStreamSerializeThread) {
     EXPECT_EQ(threadSerialize._events.size(), threadDeserialize._events.size());
 }
 
+
+TEST_F(PerformanTest, TestCounterValuesDelta) {
+    Performan::CounterValues start;
+    start._cycles = 100;
+    start._instructions = 200;
+    start._llcMisses = 3;
+    start._branchMisses = 4;
+
+    Performan::CounterValues end;
+    end._cycles = 1100;
+    end._instructions = 2200;
+    end._llcMisses = 13;
+    end._branchMisses = 5;
+
+    Performan::CounterValues delta = end - start;
+    EXPECT_EQ(delta._cycles, 1000);
+    EXPECT_EQ(delta._instructions, 2000);
+    EXPECT_EQ(delta._llcMisses, 10);
+    EXPECT_EQ(delta._branchMisses, 1);
+}
+
+TEST_F(PerformanTest, TestHardwareCountersFallback) {
+    Performan::HardwareCounters counters;
+    EXPECT_FALSE(counters.IsValid());
+
+    Performan::CounterValues values = counters.Read();
+    EXPECT_EQ(values._cycles, 0);
+    EXPECT_EQ(values._instructions, 0);
+
+    // Either the kernel gives us counters or we keep zeroed readings
+    if (counters.Open()) {
+        EXPECT_TRUE(counters.IsValid());
+        counters.Close();
+    }
+    EXPECT_FALSE(counters.IsValid());
+}
+
+TEST_F(PerformanTest, TestStreamSerializeEventCounters) {
+    Performan::Allocator& allocator = Performan::GetDefaultAllocator();
+    Performan::WriteStream wStream(&allocator);
+
+    Performan::Event evtSerialize("Test");
+    evtSerialize._counters._cycles = 1234;
+    evtSerialize._counters._instructions = 5678;
+    evtSerialize._counters._llcMisses = 9;
+    evtSerialize._counters._branchMisses = 10;
+    evtSerialize.Serialize(wStream);
+
+    Performan::Event evtDeserialize;
+    Performan::ReadStream rStream(&allocator, wStream.Data(), wStream.Size());
+    evtDeserialize.Serialize(rStream);
+
+    EXPECT_EQ(evtSerialize._counters._cycles, evtDeserialize._counters._cycles);
+    EXPECT_EQ(evtSerialize._counters._instructions, evtDeserialize._counters._instructions);
+    EXPECT_EQ(evtSerialize._counters._llcMisses, evtDeserialize._counters._llcMisses);
+    EXPECT_EQ(evtSerialize._counters._branchMisses, evtDeserialize._counters._branchMisses);
+}
+
+TEST_F(PerformanTest, TestAnalyzeEventsCounters) {
+    std::vector<Performan::Thread> threads(1);
+
+    Performan::Event evt("Physics");
+    evt._end = evt._start + std::chrono::microseconds(10);
+    evt._counters._cycles = 1000;
+    evt._counters._instructions = 500;
+    evt._counters._llcMisses = 20;
+    threads[0]._events.push_back(evt);
+    threads[0]._events.push_back(evt);
+
+    std::vector<Performan::EventStats> stats = Performan::AnalyzeEvents(threads);
+
+    ASSERT_EQ(stats.size(), 1);
+    EXPECT_STREQ(stats[0]._name, "Physics");
+    EXPECT_EQ(stats[0]._calls, 2);
+    EXPECT_EQ(stats[0]._total, std::chrono::microseconds(20));
+    EXPECT_DOUBLE_EQ(stats[0].InstructionsPerCycle(), 0.5);
+    EXPECT_DOUBLE_EQ(stats[0].LlcMissesPerCall(), 20.0);
+}
+
+TEST_F(PerformanTest, TestScopedEventWithoutThreadMacro) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+    profiler->StartCapture();
+
+    std::thread worker([]() {
+        PM_SCOPED_EVENT("Work");
+    });
+    worker.join();
+
+    profiler->StopCapture();
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 1);
+    EXPECT_STREQ(threads[0]._events[0]._name, "Work");
+
+    // The worker exited, its data is released by the previous flush
+    profiler->StartCapture();
+    profiler->StopCapture();
+    EXPECT_TRUE(ReadCapture(capture).empty());
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestConcurrentThreadRegistration) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+    profiler->StartCapture();
+
+    constexpr int threadCount = 8;
+    std::vector<std::thread> workers;
+    for (int index = 0; index < threadCount; index++) {
+        workers.emplace_back([]() {
+            PM_THREAD("Worker");
+            PM_SCOPED_EVENT("Work");
+        });
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    profiler->StopCapture();
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+
+    ASSERT_EQ(threads.size(), threadCount);
+    for (const Performan::Thread& thread : threads) {
+        EXPECT_STREQ(thread._name, "Worker");
+        EXPECT_EQ(thread._events.size(), 1);
+    }
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestRemoveThreadKeepsDataUntilFlush) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+    profiler->StartCapture();
+
+    Performan::SoftPtr<Performan::Thread> thread = profiler->AddThread("Main");
+    {
+        PM_SCOPED_EVENT("Work");
+    }
+    profiler->RemoveThread(thread);
+
+    profiler->StopCapture();
+    EXPECT_EQ(ReadCapture(capture).size(), 1);
+
+    profiler->StartCapture();
+    profiler->StopCapture();
+    EXPECT_TRUE(ReadCapture(capture).empty());
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestCaptureDisabledRecordsNothing) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    EXPECT_FALSE(Performan::Profiler::IsCapturing());
+    {
+        PM_SCOPED_FRAME();
+        PM_SCOPED_EVENT("Disabled");
+        EXPECT_EQ(pmEventScope._thread._ptr, nullptr);
+        EXPECT_EQ(pmFrameScope._thread._ptr, nullptr);
+    }
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT("Enabled");
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 1);
+    EXPECT_STREQ(threads[0]._events[0]._name, "Enabled");
+    EXPECT_FALSE(Performan::Profiler::IsCapturing());
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestCaptureCategoryFilter) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    constexpr Performan::CategoryMask physics = Performan::UserCategory;
+    constexpr Performan::CategoryMask audio = Performan::UserCategory << 1;
+
+    profiler->StartCapture(physics);
+    {
+        PM_SCOPED_EVENT_CATEGORY("Physics", physics);
+    }
+    {
+        PM_SCOPED_EVENT_CATEGORY("Audio", audio);
+    }
+    {
+        PM_SCOPED_EVENT("Default");
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 1);
+    EXPECT_STREQ(threads[0]._events[0]._name, "Physics");
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestCaptureRestartDropsPreviousData) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT("First");
+    }
+    profiler->StopCapture();
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT("Second");
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 1);
+    EXPECT_STREQ(threads[0]._events[0]._name, "Second");
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestScopeAcrossCaptureRestart) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_FRAME();
+        PM_SCOPED_EVENT_ARGS("Outer", "id", 7);
+        profiler->StopCapture();
+
+        profiler->StartCapture();
+        {
+            PM_SCOPED_EVENT_ARGS("Inner", "size", 123);
+        }
+    }
+    profiler->StopCapture();
+
+    // Scopes begun in the first capture are not recorded into the second one
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    EXPECT_TRUE(threads[0]._frames.empty());
+    ASSERT_EQ(threads[0]._events.size(), 1);
+
+    const Performan::Event& inner = threads[0]._events[0];
+    EXPECT_STREQ(inner._name, "Inner");
+    ASSERT_EQ(inner._argsCount, 1);
+    const Performan::EventArg* size = Performan::FindEventArg(threads[0], inner, "size");
+    ASSERT_NE(size, nullptr);
+    EXPECT_EQ(size->_int, 123);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestScopedEventArgs) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    std::string assetName = "rock.mesh";
+    const char* internedName = profiler->InternString(assetName.c_str());
+    EXPECT_EQ(internedName, profiler->InternString("rock.mesh"));
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT_ARGS("LoadAsset", "size", 4096, "ratio", 0.5, "asset", internedName);
+        {
+            PM_SCOPED_EVENT("Decompress");
+        }
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 2);
+
+    const Performan::Event& decompress = threads[0]._events[0];
+    const Performan::Event& loadAsset = threads[0]._events[1];
+    EXPECT_EQ(decompress._argsCount, 0);
+    ASSERT_EQ(loadAsset._argsCount, 3);
+
+    const Performan::EventArg* size = Performan::FindEventArg(threads[0], loadAsset, "size");
+    ASSERT_NE(size, nullptr);
+    EXPECT_EQ(size->_type, Performan::EventArg::Int64);
+    EXPECT_EQ(size->_int, 4096);
+
+    const Performan::EventArg* ratio = Performan::FindEventArg(threads[0], loadAsset, "ratio");
+    ASSERT_NE(ratio, nullptr);
+    EXPECT_EQ(ratio->_type, Performan::EventArg::Double);
+    EXPECT_DOUBLE_EQ(ratio->_double, 0.5);
+
+    const Performan::EventArg* asset = Performan::FindEventArg(threads[0], loadAsset, "asset");
+    ASSERT_NE(asset, nullptr);
+    EXPECT_EQ(asset->_type, Performan::EventArg::String);
+    EXPECT_STREQ(asset->_string, "rock.mesh");
+
+    EXPECT_EQ(Performan::FindEventArg(threads[0], loadAsset, "missing"), nullptr);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestAddArgsAfterNestedScope) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT("LoadAsset");
+        {
+            PM_SCOPED_EVENT_ARGS("Decompress", "bytes", 512);
+        }
+        pmEventScope.AddArgs("size", 4096);
+        {
+            PM_SCOPED_EVENT_ARGS("Upload", "slot", 3);
+        }
+        pmEventScope.AddArgs("mips", 10);
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 3);
+
+    // Arguments added after a nested scope pushed its own ones still belong to the outer event
+    const Performan::Event& decompress = threads[0]._events[0];
+    const Performan::Event& upload = threads[0]._events[1];
+    const Performan::Event& loadAsset = threads[0]._events[2];
+    EXPECT_STREQ(loadAsset._name, "LoadAsset");
+    ASSERT_EQ(loadAsset._argsCount, 2);
+
+    const Performan::EventArg* size = Performan::FindEventArg(threads[0], loadAsset, "size");
+    ASSERT_NE(size, nullptr);
+    EXPECT_EQ(size->_int, 4096);
+    const Performan::EventArg* mips = Performan::FindEventArg(threads[0], loadAsset, "mips");
+    ASSERT_NE(mips, nullptr);
+    EXPECT_EQ(mips->_int, 10);
+    EXPECT_EQ(Performan::FindEventArg(threads[0], loadAsset, "bytes"), nullptr);
+    EXPECT_EQ(Performan::FindEventArg(threads[0], loadAsset, "slot"), nullptr);
+
+    ASSERT_EQ(decompress._argsCount, 1);
+    EXPECT_NE(Performan::FindEventArg(threads[0], decompress, "bytes"), nullptr);
+    ASSERT_EQ(upload._argsCount, 1);
+    EXPECT_NE(Performan::FindEventArg(threads[0], upload, "slot"), nullptr);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestAnalyzeEventsByArg) {
+    std::vector<Performan::Thread> threads(1);
+    Performan::Thread& thread = threads[0];
+
+    auto addEvent = [&thread](int64_t size, int64_t durationUs) {
+        Performan::Event evt("LoadAsset");
+        evt._end = evt._start + std::chrono::microseconds(durationUs);
+        evt._argsOffset = static_cast<uint32_t>(thread._args.size());
+        evt._argsCount = 1;
+        thread._args.emplace_back("size", size);
+        thread._events.push_back(evt);
+    };
+
+    addEvent(100, 10);
+    addEvent(900, 30);
+    addEvent(1500, 100);
+    thread._events.emplace_back("LoadAsset"); // No argument, ignored
+
+    std::vector<Performan::ArgBucketStats> buckets = Performan::AnalyzeEventsByArg(threads, "LoadAsset", "size", 1000.0);
+
+    ASSERT_EQ(buckets.size(), 2);
+    EXPECT_DOUBLE_EQ(buckets[0]._bucket, 0.0);
+    EXPECT_EQ(buckets[0]._count, 2);
+    EXPECT_EQ(buckets[0]._p50, std::chrono::microseconds(10));
+    EXPECT_EQ(buckets[0]._p99, std::chrono::microseconds(30));
+    EXPECT_DOUBLE_EQ(buckets[1]._bucket, 1000.0);
+    EXPECT_EQ(buckets[1]._count, 1);
+    EXPECT_EQ(buckets[1]._max, std::chrono::microseconds(100));
+}
+
+TEST_F(PerformanTest, TestSharedMemoryCapture) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    ASSERT_TRUE(profiler->EnableSharedMemory("performantest"));
+    profiler->StartCapture();
+
+    std::thread worker([]() {
+        PM_THREAD("Worker");
+        {
+            PM_SCOPED_FRAME();
+            PM_SCOPED_EVENT("Work");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        {
+            PM_SCOPED_FRAME();
+            PM_FRAME_WAIT(std::chrono::milliseconds(1));
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    worker.join();
+
+    std::string name = "/performantest." + std::to_string(Performan::GetProcessId());
+    Performan::SharedMemoryReader reader;
+    ASSERT_TRUE(reader.Open(name.c_str()));
+    EXPECT_EQ(reader.ProcessId(), Performan::GetProcessId());
+    EXPECT_TRUE(reader.IsProcessAlive());
+
+    EXPECT_EQ(reader.Drain(), 4);
+    EXPECT_EQ(reader.Drain(), 0);
+
+    ASSERT_EQ(reader.Threads().size(), 1);
+    const Performan::Thread& thread = reader.Threads()[0];
+    EXPECT_STREQ(thread._name, "Worker");
+    EXPECT_EQ(thread._processId, Performan::GetProcessId());
+    ASSERT_EQ(thread._events.size(), 2);
+    EXPECT_STREQ(thread._events[0]._name, "Work");
+    EXPECT_STREQ(thread._events[1]._name, "FrameWait");
+    EXPECT_EQ(reader.Dropped(), 0);
+
+    // Frame times survive the ring
+    ASSERT_EQ(thread._frames.size(), 2);
+    EXPECT_EQ(thread._frames[0]._gap.count(), 0);
+    EXPECT_GE(thread._frames[1]._gap, std::chrono::milliseconds(1));
+    EXPECT_EQ(thread._frames[1]._waitIntended, std::chrono::milliseconds(1));
+    EXPECT_GE(thread._frames[1]._waitActual, std::chrono::milliseconds(1));
+
+    // Calibrated in the background, published by the time StopCapture returns
+    profiler->StopCapture();
+    EXPECT_GT(reader.EventOverhead().count(), 0);
+    EXPECT_GT(reader.FrameOverhead().count(), 0);
+
+    reader.Close(true);
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestSharedMemoryDropsArgs) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    ASSERT_TRUE(profiler->EnableSharedMemory("performantest.args"));
+    profiler->StartCapture();
+
+    std::thread worker([]() {
+        PM_THREAD("Worker");
+        PM_SCOPED_EVENT_ARGS("LoadAsset", "size", 4096, "ratio", 0.5);
+    });
+    worker.join();
+
+    std::string name = "/performantest.args." + std::to_string(Performan::GetProcessId());
+    Performan::SharedMemoryReader reader;
+    ASSERT_TRUE(reader.Open(name.c_str()));
+
+    // The event is collected, its arguments are counted as dropped
+    EXPECT_EQ(reader.Drain(), 1);
+    ASSERT_EQ(reader.Threads().size(), 1);
+    ASSERT_EQ(reader.Threads()[0]._events.size(), 1);
+    EXPECT_EQ(reader.Threads()[0]._events[0]._argsCount, 0);
+    EXPECT_EQ(reader.DroppedArgs(), 2);
+    EXPECT_EQ(reader.Dropped(), 0);
+
+    reader.Close(true);
+    profiler->StopCapture();
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestSharedRingOverflow) {
+    std::string name = "/performantest.ring." + std::to_string(Performan::GetProcessId());
+
+    Performan::SharedMemorySegment segment;
+    ASSERT_TRUE(segment.Create(name.c_str(), 1, 2));
+
+    Performan::SharedRing* ring = segment.AcquireRing("Ring");
+    ASSERT_NE(ring, nullptr);
+    EXPECT_EQ(segment.AcquireRing("NoRingLeft"), nullptr);
+
+    Performan::PortableTimePoint now = std::chrono::steady_clock::now();
+    EXPECT_TRUE(ring->Push(Performan::SharedRecord(Performan::SharedRecord::EventRecord, "First", now, now)));
+    EXPECT_TRUE(ring->Push(Performan::SharedRecord(Performan::SharedRecord::EventRecord, "Second", now, now)));
+    EXPECT_FALSE(ring->Push(Performan::SharedRecord(Performan::SharedRecord::EventRecord, "Third", now, now)));
+
+    Performan::SharedMemoryReader reader;
+    ASSERT_TRUE(reader.Open(name.c_str()));
+    EXPECT_EQ(reader.Drain(), 2);
+    EXPECT_EQ(reader.Dropped(), 1);
+
+    // Drained records free the ring
+    EXPECT_TRUE(ring->Push(Performan::SharedRecord(Performan::SharedRecord::EventRecord, "Fourth", now, now)));
+    EXPECT_EQ(reader.Drain(), 1);
+
+    ASSERT_EQ(reader.Threads()[0]._events.size(), 3);
+    EXPECT_STREQ(reader.Threads()[0]._events[2]._name, "Fourth");
+    EXPECT_EQ(reader.FallbackThreads(), 1);
+
+    reader.Close(false);
+    segment.Close(true);
+}
+
+TEST_F(PerformanTest, TestSharedRingReuse) {
+    std::string name = "/performantest.reuse." + std::to_string(Performan::GetProcessId());
+
+    Performan::SharedMemorySegment segment;
+    ASSERT_TRUE(segment.Create(name.c_str(), 1, 4));
+
+    Performan::SharedMemoryReader reader;
+    ASSERT_TRUE(reader.Open(name.c_str()));
+
+    Performan::PortableTimePoint now = std::chrono::steady_clock::now();
+    Performan::SharedRing* ring = segment.AcquireRing("First");
+    ASSERT_NE(ring, nullptr);
+    EXPECT_TRUE(ring->Push(Performan::SharedRecord(Performan::SharedRecord::EventRecord, "FirstWork", now, now)));
+    segment.ReleaseRing(ring);
+
+    // Records of the released thread are pending, the ring is not handed out yet
+    EXPECT_EQ(segment.AcquireRing("Second"), nullptr);
+    EXPECT_EQ(reader.FallbackThreads(), 1);
+
+    EXPECT_EQ(reader.Drain(), 1);
+    EXPECT_EQ(segment.AcquireRing("Second"), ring);
+    EXPECT_TRUE(ring->Push(Performan::SharedRecord(Performan::SharedRecord::EventRecord, "SecondWork", now, now)));
+    EXPECT_EQ(reader.Drain(), 1);
+
+    // The new owner gets its own thread
+    ASSERT_EQ(reader.Threads().size(), 2);
+    EXPECT_STREQ(reader.Threads()[0]._name, "First");
+    ASSERT_EQ(reader.Threads()[0]._events.size(), 1);
+    EXPECT_STREQ(reader.Threads()[0]._events[0]._name, "FirstWork");
+    EXPECT_STREQ(reader.Threads()[1]._name, "Second");
+    ASSERT_EQ(reader.Threads()[1]._events.size(), 1);
+    EXPECT_STREQ(reader.Threads()[1]._events[0]._name, "SecondWork");
+
+    reader.Close(false);
+    segment.Close(true);
+}
+
+TEST_F(PerformanTest, TestSharedMemoryShortLivedThreads) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    ASSERT_TRUE(profiler->EnableSharedMemory("performantest.pool", 2));
+    std::string name = "/performantest.pool." + std::to_string(Performan::GetProcessId());
+    Performan::SharedMemoryReader reader;
+    ASSERT_TRUE(reader.Open(name.c_str()));
+
+    // More pool workers than rings within one capture, each one gone before the next starts.
+    // Exiting workers give their ring back, once drained it goes to the next worker.
+    profiler->StartCapture();
+    const char* names[] = { "Worker0", "Worker1", "Worker2", "Worker3", "Worker4" };
+    for (const char* workerName : names)
+    {
+        std::thread worker([workerName]() {
+            PM_THREAD(workerName);
+            PM_SCOPED_EVENT("Work");
+        });
+        worker.join();
+        reader.Drain();
+    }
+    profiler->StopCapture();
+
+    EXPECT_EQ(reader.FallbackThreads(), 0);
+    ASSERT_EQ(reader.Threads().size(), 5);
+    for (size_t index = 0; index < 5; index++)
+    {
+        EXPECT_STREQ(reader.Threads()[index]._name, names[index]);
+        ASSERT_EQ(reader.Threads()[index]._events.size(), 1);
+        EXPECT_STREQ(reader.Threads()[index]._events[0]._name, "Work");
+    }
+
+    reader.Close(true);
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestDurationHistogramBuckets) {
+    for (uint64_t value : { 0ull, 1ull, 15ull, 16ull, 17ull, 100ull, 1000ull, 16'000'000ull, 123'456'789'012ull }) {
+        uint32_t index = Performan::DurationHistogram::BucketIndex(value);
+        ASSERT_LT(index, Performan::DurationHistogram::BucketCount);
+
+        uint64_t bucketValue = Performan::DurationHistogram::BucketValue(index);
+        uint64_t error = bucketValue > value ? bucketValue - value : value - bucketValue;
+        EXPECT_LE(error, value / Performan::DurationHistogram::SubBucketCount) << value;
+    }
+
+    EXPECT_LT(Performan::DurationHistogram::BucketIndex(UINT64_MAX), Performan::DurationHistogram::BucketCount);
+}
+
+TEST_F(PerformanTest, TestHistogramSnapshotPercentiles) {
+    Performan::DurationHistogram histogram;
+    for (int64_t value = 1; value <= 1000; value++) {
+        histogram.Record(std::chrono::microseconds(value));
+    }
+
+    Performan::HistogramSnapshot snapshot;
+    snapshot.Merge(histogram);
+    snapshot.Merge(snapshot); // Merging doubles counts, percentiles are unchanged
+    Performan::DurationStats stats = snapshot.Stats();
+
+    EXPECT_EQ(stats._count, 2000);
+    EXPECT_EQ(stats._max, std::chrono::microseconds(1000));
+    EXPECT_NEAR(static_cast<double>(stats._p50.count()), 500'000.0, 500'000.0 / 16);
+    EXPECT_NEAR(static_cast<double>(stats._p99.count()), 990'000.0, 990'000.0 / 16);
+    EXPECT_NEAR(static_cast<double>(stats._mean.count()), 500'500.0, 1.0);
+}
+
+TEST_F(PerformanTest, TestQueryStatsWithoutCapture) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    bool saved = false;
+    profiler->SetSaveCallback([&saved](uint8_t*, uint32_t) { saved = true; });
+    profiler->EnableStats();
+    EXPECT_FALSE(Performan::Profiler::IsCapturing());
+
+    auto work = []() {
+        for (int index = 0; index < 10; index++) {
+            PM_SCOPED_FRAME();
+            PM_SCOPED_EVENT("Physics");
+        }
+    };
+
+    std::thread worker(work);
+    worker.join();
+    work();
+
+    // The worker exited, its statistics outlive it
+    Performan::DurationStats physics = profiler->QueryStats("Physics");
+    EXPECT_EQ(physics._count, 20);
+    EXPECT_LE(physics._p50, physics._p99);
+    EXPECT_LE(physics._p99, physics._max);
+
+    EXPECT_EQ(profiler->QueryFrameStats()._count, 20);
+    EXPECT_EQ(profiler->QueryStats("Missing")._count, 0);
+
+    profiler->DisableStats();
+    {
+        PM_SCOPED_EVENT("Physics");
+    }
+    EXPECT_EQ(profiler->QueryStats("Physics")._count, 20);
+    EXPECT_FALSE(saved);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestColumnarFromThreads) {
+    std::vector<Performan::Thread> threads(1);
+    Performan::Thread& thread = threads[0];
+    thread._name = "Main";
+
+    // Events are stored by end time, nested ones first
+    std::string physics = "Physics";
+    Performan::Event inner(physics.c_str());
+    inner._start += std::chrono::microseconds(2);
+    inner._end = inner._start + std::chrono::microseconds(3);
+    Performan::Event outer("Update");
+    outer._start = inner._start - std::chrono::microseconds(2);
+    outer._end = outer._start + std::chrono::microseconds(10);
+    Performan::Event other("Physics");
+    other._start = outer._end;
+    other._end = other._start + std::chrono::microseconds(4);
+    thread._events = { inner, outer, other };
+
+    Performan::Frame frame;
+    frame._start = outer._start;
+    frame._end = other._start;
+    thread._frames.push_back(frame);
+
+    Performan::ColumnarCapture capture = Performan::ColumnarCapture::FromThreads(threads);
+    ASSERT_EQ(capture._threads.size(), 1);
+    const Performan::ColumnarThread& columns = capture._threads[0];
+
+    // Names are interned by content, not by pointer
+    EXPECT_EQ(capture._names.size(), 2);
+    uint32_t physicsId = capture.FindName("Physics");
+    ASSERT_NE(physicsId, Performan::ColumnarCapture::InvalidNameId);
+    EXPECT_EQ(capture.FindName("Missing"), Performan::ColumnarCapture::InvalidNameId);
+
+    ASSERT_EQ(columns._starts.size(), 3);
+    EXPECT_TRUE(std::is_sorted(columns._starts.begin(), columns._starts.end()));
+    EXPECT_EQ(columns._nameIds[1], physicsId);
+    EXPECT_EQ(columns._nameIds[2], physicsId);
+    EXPECT_EQ(columns._durations[0], std::chrono::nanoseconds(std::chrono::microseconds(10)).count());
+
+    int64_t total = 0;
+    Performan::SumDurationsPerFrame(columns._starts.data(), columns._durations.data(), columns._weights.data(), columns._nameIds.data(), columns._starts.size(),
+        columns._frameStarts.data(), columns._frameEnds.data(), 1, physicsId, &total);
+    EXPECT_EQ(total, std::chrono::nanoseconds(std::chrono::microseconds(3)).count()); // "other" starts at the frame end
+}
+
+TEST_F(PerformanTest, TestSimdKernelsMatchScalar) {
+    const size_t count = 1003; // Not a multiple of any vector width
+    std::vector<int64_t> starts(count), ends(count);
+    std::vector<uint32_t> nameIds(count);
+    std::vector<uint32_t> weights(count);
+
+    uint64_t seed = 42;
+    auto next = [&seed]() {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return seed >> 33;
+    };
+
+    int64_t time = 0;
+    for (size_t index = 0; index < count; index++) {
+        time += static_cast<int64_t>(next() % 1000);
+        starts[index] = time;
+        ends[index] = time + static_cast<int64_t>(next() % 100'000) - 10; // A few negative durations
+        nameIds[index] = static_cast<uint32_t>(next() % 7);
+        weights[index] = index % 5 == 0 ? static_cast<uint32_t>(next()) : 1 + static_cast<uint32_t>(next() % 64); // Some above 2^30
+    }
+
+    const int64_t frameStarts[] = { 0, time / 3, time / 2 };
+    const int64_t frameEnds[] = { time / 3, time / 2, time + 1 };
+
+    struct Results {
+        std::vector<int64_t> _durations;
+        uint64_t _matches = 0;
+        int64_t _total = 0;
+        std::vector<uint32_t> _indices;
+        std::vector<uint64_t> _bins;
+        std::vector<uint64_t> _wideBins;
+        int64_t _frameTotals[3] = {};
+        int64_t _frameNameTotals[3] = {};
+        uint64_t _weightedMatches = 0;
+        int64_t _weightedTotal = 0;
+        std::vector<uint64_t> _weightedBins;
+        int64_t _weightedFrameTotals[3] = {};
+        int64_t _weightedFrameNameTotals[3] = {};
+    };
+
+    auto run = [&](Performan::SimdLevel level) {
+        EXPECT_TRUE(Performan::SetSimdLevel(level));
+        Results results;
+        results._durations.resize(count);
+        Performan::ComputeDurations(starts.data(), ends.data(), results._durations.data(), count);
+        Performan::SumDurationsByName(nameIds.data(), results._durations.data(), nullptr, count, 3, results._matches, results._total);
+        Performan::FilterByName(nameIds.data(), count, 3, results._indices);
+        results._bins.resize(97);
+        Performan::HistogramDurations(results._durations.data(), nullptr, count, 1000, results._bins.data(), results._bins.size());
+        results._wideBins.resize(4);
+        Performan::HistogramDurations(results._durations.data(), nullptr, count, 7, results._wideBins.data(), results._wideBins.size());
+        Performan::SumDurationsPerFrame(starts.data(), results._durations.data(), nullptr, nameIds.data(), count, frameStarts, frameEnds, 3,
+            Performan::ColumnarCapture::InvalidNameId, results._frameTotals);
+        Performan::SumDurationsPerFrame(starts.data(), results._durations.data(), nullptr, nameIds.data(), count, frameStarts, frameEnds, 3,
+            3, results._frameNameTotals);
+
+        Performan::SumDurationsByName(nameIds.data(), results._durations.data(), weights.data(), count, 3, results._weightedMatches, results._weightedTotal);
+        results._weightedBins.resize(97);
+        Performan::HistogramDurations(results._durations.data(), weights.data(), count, 1000, results._weightedBins.data(), results._weightedBins.size());
+        Performan::SumDurationsPerFrame(starts.data(), results._durations.data(), weights.data(), nameIds.data(), count, frameStarts, frameEnds, 3,
+            Performan::ColumnarCapture::InvalidNameId, results._weightedFrameTotals);
+        Performan::SumDurationsPerFrame(starts.data(), results._durations.data(), weights.data(), nameIds.data(), count, frameStarts, frameEnds, 3,
+            3, results._weightedFrameNameTotals);
+        return results;
+    };
+
+    Performan::SimdLevel detected = Performan::GetSimdLevel();
+    Results scalar = run(Performan::SimdScalar);
+    Results simd = run(detected);
+
+    EXPECT_EQ(scalar._durations, simd._durations);
+    EXPECT_EQ(scalar._matches, simd._matches);
+    EXPECT_EQ(scalar._matches, scalar._indices.size());
+    EXPECT_EQ(scalar._total, simd._total);
+    EXPECT_EQ(scalar._indices, simd._indices);
+    EXPECT_EQ(scalar._bins, simd._bins);
+    EXPECT_EQ(scalar._wideBins, simd._wideBins);
+    EXPECT_EQ(scalar._weightedMatches, simd._weightedMatches);
+    EXPECT_EQ(scalar._weightedTotal, simd._weightedTotal);
+    EXPECT_EQ(scalar._weightedBins, simd._weightedBins);
+    for (size_t frame = 0; frame < 3; frame++) {
+        EXPECT_EQ(scalar._frameTotals[frame], simd._frameTotals[frame]);
+        EXPECT_EQ(scalar._frameNameTotals[frame], simd._frameNameTotals[frame]);
+        EXPECT_EQ(scalar._weightedFrameTotals[frame], simd._weightedFrameTotals[frame]);
+        EXPECT_EQ(scalar._weightedFrameNameTotals[frame], simd._weightedFrameNameTotals[frame]);
+    }
+
+    uint64_t binned = 0;
+    for (uint64_t bin : scalar._bins) {
+        binned += bin;
+    }
+    EXPECT_EQ(binned, count);
+
+    uint64_t weightedBinned = 0;
+    for (uint64_t bin : scalar._weightedBins) {
+        weightedBinned += bin;
+    }
+    uint64_t weightSum = 0;
+    for (uint32_t weight : weights) {
+        weightSum += weight;
+    }
+    EXPECT_EQ(weightedBinned, weightSum);
+}
+
+TEST_F(PerformanTest, TestSampledEventOneInN) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    auto update = []() {
+        PM_SCOPED_EVENT_SAMPLED("UpdateEntity", Performan::SamplingPolicy::OneIn(10));
+    };
+
+    update(); // Not capturing, not counted
+    profiler->StartCapture();
+    for (int index = 0; index < 100; index++) {
+        update();
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 10);
+    EXPECT_EQ(threads[0]._events[0]._weight, 10);
+
+    std::vector<Performan::EventStats> stats = Performan::AnalyzeEvents(threads);
+    ASSERT_EQ(stats.size(), 1);
+    EXPECT_EQ(stats[0]._calls, 100);
+    EXPECT_EQ(stats[0]._samples, 10);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestColumnarSampledCapture) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_FRAME();
+        for (int index = 0; index < 100; index++) {
+            PM_SCOPED_EVENT_SAMPLED("UpdateEntity", Performan::SamplingPolicy::OneIn(10));
+        }
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._frames.size(), 1);
+
+    Performan::ColumnarCapture columnar = Performan::ColumnarCapture::FromThreads(threads);
+    const Performan::ColumnarThread& columns = columnar._threads[0];
+    ASSERT_EQ(columns._weights.size(), 10);
+    uint32_t nameId = columnar.FindName("UpdateEntity");
+
+    // The columns scale the kept events back to the calls, as AnalyzeEvents does
+    std::vector<Performan::EventStats> stats = Performan::AnalyzeEvents(threads);
+    ASSERT_EQ(stats.size(), 1);
+
+    uint64_t matches = 0;
+    int64_t total = 0;
+    Performan::SumDurationsByName(columns._nameIds.data(), columns._durations.data(), columns._weights.data(), columns._durations.size(), nameId, matches, total);
+    EXPECT_EQ(matches, 100);
+    EXPECT_EQ(total, stats[0]._total.count());
+
+    int64_t frameTotal = 0;
+    Performan::SumDurationsPerFrame(columns._starts.data(), columns._durations.data(), columns._weights.data(), columns._nameIds.data(), columns._starts.size(),
+        columns._frameStarts.data(), columns._frameEnds.data(), 1, nameId, &frameTotal);
+    EXPECT_EQ(frameTotal, total);
+
+    uint64_t bins[4] = {};
+    Performan::HistogramDurations(columns._durations.data(), columns._weights.data(), columns._durations.size(), 1000, bins, 4);
+    EXPECT_EQ(bins[0] + bins[1] + bins[2] + bins[3], 100);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestSampledEventFrameBudget) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    for (int frame = 0; frame < 5; frame++)
+    {
+        PM_SCOPED_FRAME();
+        for (int index = 0; index < 10; index++) {
+            // The first call of each frame exhausts the budget
+            PM_SCOPED_EVENT_SAMPLED("Particles", Performan::SamplingPolicy::BudgetPerFrame(std::chrono::nanoseconds(1)));
+        }
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 5);
+    EXPECT_EQ(threads[0]._events[0]._weight, 10);
+    EXPECT_EQ(threads[0]._events[3]._weight, 10);
+    EXPECT_EQ(threads[0]._events[4]._weight, 10); // Calls skipped in the last frame are added by StopCapture
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestSampledEventFrameBudgetHeavyFrame) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    const uint32_t calls[] = { 2, 50, 2, 2, 1 };
+    profiler->StartCapture();
+    for (uint32_t count : calls)
+    {
+        PM_SCOPED_FRAME();
+        for (uint32_t index = 0; index < count; index++) {
+            PM_SCOPED_EVENT_SAMPLED("Particles", Performan::SamplingPolicy::BudgetPerFrame(std::chrono::nanoseconds(1)));
+        }
+    }
+    profiler->StopCapture();
+
+    // Each frame records one event standing for all of its calls
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._events.size(), 5);
+    for (size_t index = 0; index < 5; index++) {
+        EXPECT_EQ(threads[0]._events[index]._weight, calls[index]);
+    }
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestSampledEventWithoutFrames) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    // Job worker without any frame, the budget starts over every window
+    auto work = []() {
+        for (int index = 0; index < 1000; index++)
+        {
+            {
+                PM_SCOPED_EVENT_SAMPLED("Job", Performan::SamplingPolicy::BudgetPerFrame(std::chrono::nanoseconds(1), std::chrono::microseconds(50)));
+            }
+            {
+                PM_SCOPED_EVENT_SAMPLED("Task", Performan::SamplingPolicy::OneIn(64));
+            }
+        }
+    };
+
+    for (int round = 0; round < 2; round++)
+    {
+        profiler->StartCapture();
+        std::thread worker(work);
+        worker.join();
+        profiler->StopCapture();
+
+        // Every call is counted once, including the ones skipped after the last recorded event
+        std::vector<Performan::Thread> threads = ReadCapture(capture);
+        ASSERT_EQ(threads.size(), 1);
+        std::vector<Performan::EventStats> stats = Performan::AnalyzeEvents(threads);
+        ASSERT_EQ(stats.size(), 2);
+        for (const Performan::EventStats& eventStats : stats) {
+            EXPECT_EQ(eventStats._calls, 1000);
+        }
+    }
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestCaptureHeaderOverhead) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->EnableStats();
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT("Physics");
+    }
+    profiler->StopCapture();
+
+    // Calibration scopes are neither captured nor in the statistics
+    EXPECT_EQ(profiler->QueryStats("Calibration")._count, 0);
+    EXPECT_EQ(profiler->QueryFrameStats()._count, 0);
+    Performan::CaptureHeader header;
+    std::vector<Performan::Thread> threads = ReadCapture(capture, &header);
+    ASSERT_EQ(threads.size(), 1);
+    EXPECT_EQ(threads[0]._events.size(), 1);
+
+    EXPECT_GT(header._eventOverhead.count(), 0);
+    EXPECT_GT(header._frameOverhead.count(), 0);
+    EXPECT_EQ(header._eventOverhead, profiler->GetCaptureHeader()._eventOverhead);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestCalibrateOnce) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    profiler->StopCapture();
+    Performan::CaptureHeader first;
+    ReadCapture(capture, &first);
+    EXPECT_GT(first._eventOverhead.count(), 0);
+
+    // Later captures reuse the measured overhead, a restart without a stop as well
+    profiler->StartCapture();
+    profiler->StartCapture();
+    profiler->StopCapture();
+    Performan::CaptureHeader second;
+    ReadCapture(capture, &second);
+    EXPECT_EQ(second._eventOverhead, first._eventOverhead);
+    EXPECT_EQ(second._frameOverhead, first._frameOverhead);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestCompensateOverhead) {
+    std::vector<Performan::Thread> threads(1);
+    Performan::Thread& thread = threads[0];
+
+    // Root [0, 100] > Child [10, 60] > Leaf [20, 30], then Sibling [70, 90] in Root
+    auto addEvent = [&thread](const char* name, int64_t startUs, int64_t endUs) {
+        Performan::Event evt(name);
+        evt._start = Performan::PortableTimePoint(std::chrono::microseconds(startUs));
+        evt._end = Performan::PortableTimePoint(std::chrono::microseconds(endUs));
+        thread._events.push_back(evt);
+    };
+    addEvent("Leaf", 20, 30);
+    addEvent("Child", 10, 60);
+    addEvent("Sibling", 70, 90);
+    addEvent("Root", 0, 100);
+
+    // Frame [0, 110] > Nested frame [5, 65] holding Child and Leaf
+    auto addFrame = [&thread](int64_t startUs, int64_t endUs) {
+        Performan::Frame frame;
+        frame._start = Performan::PortableTimePoint(std::chrono::microseconds(startUs));
+        frame._end = Performan::PortableTimePoint(std::chrono::microseconds(endUs));
+        thread._frames.push_back(frame);
+    };
+    addFrame(5, 65);
+    addFrame(0, 110);
+
+    Performan::CaptureHeader header;
+    header._eventOverhead = std::chrono::microseconds(5);
+    header._frameOverhead = std::chrono::microseconds(2);
+    Performan::CompensateOverhead(threads, header);
+
+    auto duration = [](const auto& item) { return std::chrono::duration_cast<std::chrono::microseconds>(item._end - item._start).count(); };
+    EXPECT_EQ(duration(thread._events[0]), 10);
+    EXPECT_EQ(duration(thread._events[1]), 45);
+    EXPECT_EQ(duration(thread._events[2]), 20);
+    EXPECT_EQ(duration(thread._events[3]), 83);
+    EXPECT_EQ(duration(thread._frames[0]), 50);
+    EXPECT_EQ(duration(thread._frames[1]), 88);
+}
+
+TEST_F(PerformanTest, TestFrameNumberingAndWait) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    for (int index = 0; index < 3; index++)
+    {
+        PM_SCOPED_FRAME();
+        PM_FRAME_WAIT(std::chrono::microseconds(500));
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    {
+        PM_FRAME_WAIT(std::chrono::microseconds(500)); // Outside of any frame, only an event
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    const std::vector<Performan::Frame>& frames = threads[0]._frames;
+    ASSERT_EQ(frames.size(), 3);
+    EXPECT_EQ(threads[0]._events.size(), 4);
+    EXPECT_STREQ(threads[0]._events[0]._name, "FrameWait");
+
+    EXPECT_EQ(frames[0]._gap.count(), 0);
+    for (size_t index = 0; index < frames.size(); index++)
+    {
+        if (index > 0) {
+            EXPECT_EQ(frames[index]._frameIdx, frames[index - 1]._frameIdx + 1);
+            EXPECT_EQ(frames[index]._gap, frames[index]._start - frames[index - 1]._end);
+        }
+        EXPECT_EQ(frames[index]._waitIntended, std::chrono::microseconds(500));
+        EXPECT_GE(frames[index]._waitActual, std::chrono::microseconds(500));
+    }
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestNestedFrameWait) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture();
+    {
+        PM_SCOPED_FRAME();
+        {
+            PM_SCOPED_FRAME();
+            PM_FRAME_WAIT(std::chrono::microseconds(200));
+        }
+        PM_FRAME_WAIT(std::chrono::microseconds(500)); // The outer frame is current again
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    profiler->StopCapture();
+
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    const std::vector<Performan::Frame>& frames = threads[0]._frames;
+    ASSERT_EQ(frames.size(), 2);
+    const Performan::Frame& inner = frames[0]._frameIdx == 1 ? frames[0] : frames[1];
+    const Performan::Frame& outer = frames[0]._frameIdx == 1 ? frames[1] : frames[0];
+    EXPECT_EQ(outer._frameIdx, 0);
+    EXPECT_EQ(inner._waitIntended, std::chrono::microseconds(200));
+    EXPECT_EQ(outer._waitIntended, std::chrono::microseconds(500));
+    EXPECT_GE(outer._waitActual, std::chrono::microseconds(500));
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestFrameWaitCategoryFilter) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    profiler->StartCapture(Performan::UserCategory);
+    {
+        PM_SCOPED_FRAME();
+        PM_SCOPED_EVENT("Default"); // Filtered out
+        PM_FRAME_WAIT(std::chrono::microseconds(500));
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    profiler->StopCapture();
+
+    // Frames and their waits are not filtered by category
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    ASSERT_EQ(threads[0]._frames.size(), 1);
+    EXPECT_EQ(threads[0]._frames[0]._waitIntended, std::chrono::microseconds(500));
+    EXPECT_GE(threads[0]._frames[0]._waitActual, std::chrono::microseconds(500));
+    ASSERT_EQ(threads[0]._events.size(), 1);
+    EXPECT_STREQ(threads[0]._events[0]._name, "FrameWait");
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestAnalyzeFramePacing) {
+    Performan::Thread thread;
+
+    // 10 ms frames back to back, frame 2 lasts 40 ms because AI took 30 ms instead of 5 ms
+    auto time = Performan::PortableTimePoint(std::chrono::milliseconds(0));
+    for (uint64_t index = 0; index < 5; index++)
+    {
+        auto frameTime = std::chrono::milliseconds(index == 2 ? 40 : 10);
+        auto aiTime = std::chrono::milliseconds(index == 2 ? 30 : 5);
+
+        Performan::Event ai("AI");
+        ai._start = time;
+        ai._end = time + aiTime;
+        thread._events.push_back(ai);
+
+        Performan::Frame& frame = thread._frames.emplace_back();
+        frame._frameIdx = index;
+        frame._start = time;
+        frame._end = time + frameTime;
+        frame._waitIntended = std::chrono::milliseconds(2);
+        frame._waitActual = std::chrono::milliseconds(index == 2 ? 4 : 2);
+        time = frame._end;
+    }
+
+    Performan::FramePacingStats stats = Performan::AnalyzeFramePacing(thread, std::chrono::microseconds(16'667));
+
+    EXPECT_EQ(stats._frames, 5);
+    EXPECT_EQ(stats._mean, std::chrono::milliseconds(16));
+    EXPECT_DOUBLE_EQ(stats._variance, 144.0); // (4 * 36 + 576) / 5
+    EXPECT_EQ(stats._max, std::chrono::milliseconds(40));
+    EXPECT_EQ(stats._droppedFrames, 2);
+    EXPECT_EQ(stats._maxOversleep, std::chrono::milliseconds(2));
+
+    ASSERT_EQ(stats._lateFrames.size(), 1);
+    const Performan::LateFrame& late = stats._lateFrames[0];
+    EXPECT_EQ(late._frameIdx, 2);
+    EXPECT_EQ(late._oversleep, std::chrono::milliseconds(2));
+    ASSERT_EQ(late._culprits.size(), 1);
+    EXPECT_STREQ(late._culprits[0]._name, "AI");
+    EXPECT_EQ(late._culprits[0]._excess, std::chrono::milliseconds(25));
+}
+
+TEST_F(PerformanTest, TestStreamSerializeThreadCountersOptional) {
+    Performan::Allocator& allocator = Performan::GetDefaultAllocator();
+
+    auto serializedSize = [&allocator](Performan::Thread& thread) {
+        Performan::WriteStream wStream(&allocator);
+        thread.Serialize(wStream);
+        return wStream.Offset();
+    };
+
+    Performan::Thread thread("MainThread");
+    thread._events.emplace_back("Event");
+    thread._events.emplace_back("Event");
+    size_t withoutCounters = serializedSize(thread);
+
+    thread._events[1]._counters._cycles = 1000;
+    size_t withCounters = serializedSize(thread);
+    EXPECT_EQ(withCounters, withoutCounters + 2 * sizeof(Performan::CounterValues));
+
+    Performan::WriteStream wStream(&allocator);
+    thread.Serialize(wStream);
+    Performan::Thread threadDeserialize;
+    Performan::ReadStream rStream(&allocator, wStream.Data(), wStream.Offset());
+    threadDeserialize.Serialize(rStream);
+
+    ASSERT_EQ(threadDeserialize._events.size(), 2);
+    EXPECT_EQ(threadDeserialize._events[0]._counters._cycles, 0);
+    EXPECT_EQ(threadDeserialize._events[1]._counters._cycles, 1000);
+    EXPECT_EQ(rStream.Offset(), wStream.Offset());
+}
+
+TEST_F(PerformanTest, TestRemoveThreadDuringFlush) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    // Workers retire entries faster than a single thread flushes them, only so many are churned
+    constexpr int workerCount = 4;
+    std::atomic<int> running{ workerCount };
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < workerCount; worker++)
+    {
+        workers.emplace_back([profiler, &running]() {
+            for (int index = 0; index < 5000; index++) {
+                profiler->RemoveThread(profiler->AddThread("Worker"));
+            }
+            running.fetch_sub(1);
+        });
+    }
+
+    // Flushes release the retired entries the workers walk over
+    while (running.load() > 0) {
+        profiler->QueryFrameStats();
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestRemoveThreadFromAnotherThread) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+    profiler->SetHardwareCountersEnabled(true);
+
+    std::vector<uint8_t> capture;
+    profiler->SetSaveCallback([&capture](uint8_t* buffer, uint32_t size) { capture.assign(buffer, buffer + size); });
+
+    std::atomic<int> step{ 0 };
+    auto waitStep = [&step](int value) {
+        while (step.load() != value) {
+            std::this_thread::yield();
+        }
+    };
+
+    Performan::SoftPtr<Performan::Thread> recorder;
+    Performan::SoftPtr<Performan::Thread> idle;
+
+    // Records again once removed by the main thread
+    std::thread recording([&]() {
+        recorder = profiler->AddThread("Recorder");
+        step.store(1);
+        waitStep(2);
+        {
+            PM_SCOPED_EVENT("AfterRemove");
+        }
+        step.store(3);
+        waitStep(4);
+    });
+
+    // Exits once removed by the main thread
+    std::thread exiting([&]() {
+        idle = profiler->AddThread("Idle");
+        waitStep(4);
+    });
+
+    waitStep(1);
+    while (idle._ptr == nullptr) {
+        std::this_thread::yield();
+    }
+
+    profiler->StartCapture();
+    profiler->RemoveThread(recorder);
+    profiler->RemoveThread(idle);
+    profiler->StopCapture(); // Both are retired but still used by their threads
+
+    profiler->StartCapture();
+    step.store(2);
+    waitStep(3);
+    profiler->StopCapture();
+
+    // The recording thread registered again under its name
+    std::vector<Performan::Thread> threads = ReadCapture(capture);
+    ASSERT_EQ(threads.size(), 1);
+    EXPECT_STREQ(threads[0]._name, "Recorder");
+    ASSERT_EQ(threads[0]._events.size(), 1);
+    EXPECT_STREQ(threads[0]._events[0]._name, "AfterRemove");
+
+    step.store(4);
+    recording.join();
+    exiting.join();
+    profiler->QueryFrameStats(); // Releases the entries the threads gave up on exit
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestRemoveThreadWithOpenScope) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    profiler->EnableStats();
+    profiler->StartCapture();
+    {
+        PM_SCOPED_EVENT("Open");
+        profiler->RemoveThread(Performan::Profiler::GetCurrentThread());
+        profiler->StopCapture(); // The entry is retired but the scope still writes it
+    }
+
+    // Released once the scope ended, with its statistics
+    EXPECT_EQ(profiler->QueryStats("Open")._count, 1);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestStopCaptureWhileRecording) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+
+    size_t captures = 0;
+    profiler->SetSaveCallback([&captures](uint8_t* buffer, uint32_t size) {
+        std::vector<Performan::Thread> threads = ReadCapture(std::vector<uint8_t>(buffer, buffer + size));
+        for (const Performan::Thread& thread : threads)
+        {
+            for (const Performan::Event& evt : thread._events) {
+                EXPECT_STREQ(evt._name, "Work");
+            }
+        }
+        captures++;
+    });
+
+    std::atomic<bool> running{ true };
+    std::thread worker([&running]() {
+        while (running.load())
+        {
+            PM_SCOPED_FRAME();
+            for (int index = 0; index < 100; index++) {
+                PM_SCOPED_EVENT_ARGS("Work", "index", index);
+            }
+        }
+    });
+
+    // Scopes opened before each stop keep ending while their buffers are written
+    for (int index = 0; index < 50; index++)
+    {
+        profiler->StartCapture();
+        std::this_thread::yield();
+        profiler->StopCapture();
+    }
+
+    running.store(false);
+    worker.join();
+    EXPECT_EQ(captures, 50);
+
+    Performan::Profiler::DestroyInstance();
+}
+
+TEST_F(PerformanTest, TestStreamSerializeArgsStringTable) {
+    Performan::Allocator& allocator = Performan::GetDefaultAllocator();
+
+    Performan::Thread thread("MainThread");
+    auto addEvent = [&thread](int64_t size) {
+        Performan::Event evt("LoadAsset");
+        evt._argsOffset = static_cast<uint32_t>(thread._args.size());
+        evt._argsCount = 2;
+        thread._args.emplace_back("size", size);
+        thread._args.emplace_back("asset", "textures/rock.dds");
+        thread._events.push_back(evt);
+    };
+
+    auto serializedSize = [&allocator](Performan::Thread& thread) {
+        Performan::WriteStream wStream(&allocator);
+        thread.Serialize(wStream);
+        return wStream.Offset();
+    };
+
+    addEvent(100);
+    size_t oneEvent = serializedSize(thread);
+    addEvent(200);
+    size_t twoEvents = serializedSize(thread);
+
+    // Keys and string values are written once, arguments only hold ids
+    size_t eventSize = sizeof(int64_t) * 2 + sizeof(uint32_t) + strlen("LoadAsset") + 1 + sizeof(uint32_t) * 3;
+    size_t argsSize = (sizeof(uint32_t) + 1 + sizeof(int64_t)) + (sizeof(uint32_t) + 1 + sizeof(uint32_t));
+    EXPECT_EQ(twoEvents - oneEvent, eventSize + argsSize);
+
+    Performan::WriteStream wStream(&allocator);
+    thread.Serialize(wStream);
+    Performan::Thread threadDeserialize;
+    Performan::ReadStream rStream(&allocator, wStream.Data(), wStream.Offset());
+    threadDeserialize.Serialize(rStream);
+
+    ASSERT_EQ(threadDeserialize._args.size(), 4);
+    EXPECT_STREQ(threadDeserialize._args[2]._key, "size");
+    EXPECT_EQ(threadDeserialize._args[2]._int, 200);
+    EXPECT_STREQ(threadDeserialize._args[3]._key, "asset");
+    EXPECT_STREQ(threadDeserialize._args[3]._string, "textures/rock.dds");
+}
+
+TEST_F(PerformanTest, TestResetStats) {
+    Performan::Profiler::CreateInstance();
+    Performan::Profiler* profiler = Performan::Profiler::GetInstance();
+    profiler->EnableStats();
+
+    // A long history of fast frames, recorded partly by a thread that exits
+    auto fastFrames = []() {
+        for (int index = 0; index < 1000; index++) {
+            PM_SCOPED_FRAME();
+        }
+    };
+    std::thread worker(fastFrames);
+    worker.join();
+    fastFrames();
+    EXPECT_EQ(profiler->QueryFrameStats()._count, 2000);
+    EXPECT_LT(profiler->QueryFrameStats()._p99, std::chrono::milliseconds(1));
+
+    // Only the slow frames after the reset count, p99 reacts right away
+    profiler->ResetStats();
+    EXPECT_EQ(profiler->QueryFrameStats()._count, 0);
+
+    for (int index = 0; index < 5; index++)
+    {
+        PM_SCOPED_FRAME();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    Performan::DurationStats frames = profiler->QueryFrameStats();
+    EXPECT_EQ(frames._count, 5);
+    EXPECT_GE(frames._p99, std::chrono::microseconds(1875)); // Within 1/16th
+
+    profiler->DisableStats();
+    Performan::Profiler::DestroyInstance();
+}